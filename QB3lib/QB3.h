@@ -31,16 +31,28 @@ Contributors:  Lucian Plesea
 #endif
 
 // Keep this close to plain C so it can have a C API
-#define QB3_MAXBANDS 16
+// The format allows up to 256 bands, the band state is allocated for the actual band count
+#define QB3_MAXBANDS 256
+// Maximum number of interleaved data streams
+#define QB3_MAXSTREAMS 4
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 typedef struct encs * encsp; // encoder
 typedef struct decs * decsp; // decoder
+typedef struct tws * twsp; // tiled container writer
+typedef struct trs * trsp; // tiled container reader
+
+// Line callbacks, for rasters which are not in memory at once. ctx is passed through
+// Reads the input lines y to y + 3 into buffer, band interleaved, returns false on failure
+typedef bool (*qb3_get_lines)(void* ctx, size_t y, void* buffer);
+// Receives n output lines, starting at line y, band interleaved, returns false to stop
+typedef bool (*qb3_put_lines)(void* ctx, size_t y, size_t n, const void* buffer);
 
 // Types
-enum qb3_dtype { QB3_U8 = 0, QB3_I8, QB3_U16, QB3_I16, QB3_U32, QB3_I32, QB3_U64, QB3_I64 };
+// Floating point values are lossless only, they can't be quantized
+enum qb3_dtype { QB3_U8 = 0, QB3_I8, QB3_U16, QB3_I16, QB3_U32, QB3_I32, QB3_U64, QB3_I64, QB3_F32, QB3_F64 };
 
 // Encode mode, default is QB3M_BASE, pure QB3 encoding. Fastest
 // QB3M_BEST is the best compression, may change
@@ -66,6 +78,8 @@ enum qb3_error {
 // In QB3encode.cpp
 
 // Call before anything else
+// Width and height are between 4 and 2^32, the size of the raster is only limited by memory
+// Any type is valid, floating point values are encoded as integers with an order preserving mapping
 DLLEXPORT encsp qb3_create_encoder(size_t width, size_t height, size_t bands, qb3_dtype dt);
 // Call when done with the encoder
 DLLEXPORT void qb3_destroy_encoder(encsp p);
@@ -79,7 +93,10 @@ DLLEXPORT void qb3_reset_encoder(encsp p);
 // equivalent to cbands = { 1, 1, 1 }
 // Returns false if band number differs from the one used to create p
 // Only values < bands are acceptable in cband array
-// The cband array might be modified if core bands are not valid or iterrative
+// A band can be derived from an earlier band, core or derived, for example { 0, 0, 1, 2, ... } predicts
+// each band from the previous one. A band can only be derived from a later band if that one is a core band.
+// A band derived from a later band can't be the reference of another band, { 2, 0, 2 } becomes { 0, 0, 2 }
+// The cband array might be modified if core bands are not valid
 DLLEXPORT bool qb3_set_encoder_coreband(encsp p, size_t bands, size_t *cband);
 
 // Sets quantization parameters, returns true on success
@@ -96,10 +113,41 @@ DLLEXPORT qb3_mode qb3_set_encoder_mode(encsp p, qb3_mode mode);
 //// Generate raw qb3 stream, no headers
 //DLLEXPORT void qb3_set_encoder_raw(encsp p);
 
+// Adds an overview chunk to the output, a reduced resolution version of the image
+// built from the 4x4 block means and encoded as a QB3 stream, reduced further if needed
+// to fit in a chunk. Images smaller than 16x16 don't get an overview
+DLLEXPORT void qb3_set_encoder_overview(encsp p, bool overview);
+
+// Adds a checksum chunk to the output, with the CRC32C of the encoded data and,
+// when lossless, the CRC32C of the source raster
+DLLEXPORT void qb3_set_encoder_crc(encsp p, bool crc);
+
+// Splits the encoded data in n streams, between 1 and QB3_MAXSTREAMS, the default is 1
+// The 4x4 block columns are dealt round robin to the streams, which the decoder can read 
+// at the same time. Each stream has a little compression overhead
+// Returns the number of streams used, it can't be more than the number of block columns
+DLLEXPORT size_t qb3_set_encoder_streams(encsp p, size_t n);
+
+// Pixels where all the bands have the nodata value are masked, they are not encoded and are decoded as nodata
+// The mask is stored only if there are masked pixels, it is built from the input before encoding,
+// so qb3_encode_lines reads the input lines twice. Integer types have to hold the value exactly
+// Returns false if the value is not valid for the type, nodata = false turns the mask off
+DLLEXPORT bool qb3_set_encoder_nodata(encsp p, bool nodata, double value);
+
 // Encode the source into destination buffer, which should be at least qb3_max_encoded_size
 // Source organization is expected to be y major, then x, then band (interleaved)
 // Returns actual size, the encoder can be reused
-DLLEXPORT size_t qb3_encode(encsp p, void *source, void *destination);
+DLLEXPORT size_t qb3_encode(encsp p, const void *source, void *destination);
+
+// Same as qb3_encode, the source lines are read by fn, four at a time, from top to bottom
+// When the height is not a multiple of 4, the last lines are read twice
+// The source raster doesn't have to be in memory at once
+DLLEXPORT size_t qb3_encode_lines(encsp p, qb3_get_lines fn, void* ctx, void* destination);
+
+// Returns the exact size qb3_encode would produce for the source, or 0 on error
+// The encoder only counts the bits, it is faster than qb3_encode except for the RLE modes,
+// when the encoded stream is needed to choose and size the RLE
+DLLEXPORT size_t qb3_encoded_size(encsp p, const void* source);
 
 // Returns !0 if last encode call failed
 DLLEXPORT int qb3_get_encoder_state(encsp p);
@@ -118,10 +166,61 @@ DLLEXPORT bool qb3_read_info(decsp p);
 // Call after qb3_read_info, reads all the data, returns bytes read
 DLLEXPORT size_t qb3_read_data(decsp p, void* destination);
 
+// Call after qb3_read_info, reads the data reduced by factor in both directions, returns bytes written
+// Each output value is the mean of the input values it covers, the output size is
+// ceil(xsize / factor) by ceil(ysize / factor). Only one strip of the full resolution data is held in memory
+// The output conversion applies to the decimated values. With a nodata mask only the valid values are used,
+// the outputs which don't cover any valid value are nodata
+DLLEXPORT size_t qb3_read_decimated(decsp p, size_t factor, void* destination);
+
+// Call after qb3_read_info, decodes the data and passes it to fn, a few lines at a time, from top to bottom,
+// instead of writing it to a buffer. Each line is only passed once. The factor is the same as for qb3_read_decimated,
+// 1 for full resolution. Returns the number of bytes passed to fn, 0 on failure
+// Only a strip of lines is held in memory, the output conversion applies
+DLLEXPORT size_t qb3_read_lines(decsp p, size_t factor, qb3_put_lines fn, void* ctx);
+
+// Call after qb3_read_info, checks that the data stream is complete and consistent without
+// decoding the values or needing an output buffer, returns false if the stream is not valid
+// RLE compressed streams are expanded to a temporary buffer
+// If there is a data checksum, it has to match as well, a matching checksum alone is not sufficient
+DLLEXPORT bool qb3_validate(decsp p);
+
+// Output conversion, call after qb3_read_info and before qb3_read_data
+// The conversion is applied while the decoded values are written, no extra pass is needed
+// Output values are value * scale + offset, converted to type dt and saturated to the dt range
+// Integer outputs are rounded to nearest. Returns false if the parameters are not valid
+DLLEXPORT bool qb3_set_decoder_output(decsp p, qb3_dtype dt, double scale, double offset);
+
+// Output values are written byte swapped (big endian)
+DLLEXPORT void qb3_set_decoder_swap(decsp p, bool swap);
+
+// Adds an extra band to the output, filled with value, for example an opaque alpha
+// The value is converted to the output type
+DLLEXPORT void qb3_set_decoder_alpha(decsp p, double value);
+
+// Check the checksums while decoding, if the stream has them
+// The data checksum is checked before decoding, the raster one as the strips are decoded
+// On mismatch the read functions return 0, the output might be partially written
+DLLEXPORT void qb3_set_decoder_verify(decsp p, bool verify);
+
 DLLEXPORT void qb3_destroy_decoder(decsp p);
 
+// Overview, call after qb3_read_info
+// Returns the size of the decoded overview, 0 if there is no overview
+// image_size receives 4 values, x size, y size, number of bands and the reduction factor
+// The overview is subject to the same output conversion as the image
+DLLEXPORT size_t qb3_overview_size(const decsp p, size_t* image_size);
+
+// Reads the overview into destination, without decoding the main image, returns the bytes written
+DLLEXPORT size_t qb3_read_overview(decsp p, void* destination);
+
+// Size of the output, including the effects of output conversion
 DLLEXPORT size_t qb3_decoded_size(const decsp p);
 
+// Size of the qb3_read_decimated output, including the effects of output conversion
+DLLEXPORT size_t qb3_decimated_size(const decsp p, size_t factor);
+
+// Type of the encoded values, not affected by the output conversion
 DLLEXPORT qb3_dtype qb3_get_type(const decsp p);
 
 // Query settings, valid after qb3_read_info
@@ -132,9 +231,53 @@ DLLEXPORT qb3_mode qb3_get_mode(const decsp p);
 // Returns the number of quantization bits used, returns 0 if failed
 DLLEXPORT size_t qb3_get_quanta(const decsp p);
 
+// Number of interleaved data streams
+DLLEXPORT size_t qb3_get_streams(const decsp p);
+
+// Returns true if the raster has a nodata mask, the nodata value is returned in value
+// The masked pixels are decoded as the nodata value, before the output conversion
+DLLEXPORT bool qb3_get_nodata(const decsp p, double* value);
+
 // Sets the cband array and returns true if successful
 DLLEXPORT bool qb3_get_coreband(const decsp p, size_t *cband);
 
+// In QB3tiles.cpp
+// Tiled container, a single file with an index of tiles followed by the QB3 encoded tiles
+// All tiles have the same size, the tiles at the right and bottom edges extend past the image
+
+// Creates the container file, returns nullptr on failure
+// Tiles are between 4x4 and 65536x65536, the image can be up to 2^32 - 1 in each direction
+DLLEXPORT twsp qb3_tiled_create(const char* fname, size_t xsize, size_t ysize,
+    size_t tilex, size_t tiley, size_t bands, qb3_dtype dt);
+
+// Writes an already encoded QB3 tile, at tile column tx and row ty
+// Tiles can be written in any order, missing tiles are allowed
+DLLEXPORT bool qb3_tiled_write(twsp w, size_t tx, size_t ty, const void* data, size_t size);
+
+// Encodes the source as a tile, using the encoder p which has to match the tile size, bands and type
+DLLEXPORT bool qb3_tiled_encode(twsp w, size_t tx, size_t ty, encsp p, const void* source);
+
+// Writes the index and closes the file, returns true if all the writes succeeded
+DLLEXPORT bool qb3_tiled_finish(twsp w);
+
+// Opens a container for reading, the file is memory mapped. Returns nullptr on failure
+DLLEXPORT trsp qb3_tiled_open(const char* fname);
+
+DLLEXPORT void qb3_tiled_close(trsp r);
+
+// info receives 5 values, x size, y size, tile x size, tile y size and number of bands
+DLLEXPORT void qb3_tiled_info(const trsp r, size_t* info);
+
+DLLEXPORT qb3_dtype qb3_tiled_type(const trsp r);
+
+// Returns a decoder for a tile, after qb3_read_info, or nullptr if the tile is missing or not valid
+// The decoder reads the tile directly from the mapped file. Destroy it after use, before closing r
+// The reader can be shared by multiple threads, each using its own decoders
+DLLEXPORT decsp qb3_tiled_tile(const trsp r, size_t tx, size_t ty);
+
+// Decodes a tile, returns the bytes written, 0 if the tile is missing or on failure
+DLLEXPORT size_t qb3_tiled_read(const trsp r, size_t tx, size_t ty, void* destination);
+
 #if defined(__cplusplus)
 }
 
@@ -18,9 +18,12 @@ Contributors:  Lucian Plesea
 #pragma once
 #include "QB3.h"
 #include "bitstream.h"
+#include "bmap.h"
 #include <cinttypes>
+#include <cstring>
 #include <utility>
 #include <type_traits>
+#include <vector>
 
 #if defined(_WIN32)
 #include <intrin.h>
@@ -40,26 +43,26 @@ constexpr size_t B2(B * B);
 
 #if defined(_WIN32)
 // blog2 of val, result is undefined for val == 0
-static size_t topbit(uint64_t val) {
+static inline size_t topbit(uint64_t val) {
     return 63 - __lzcnt64(val);
 }
 
-static size_t setbits16(uint64_t val) {
+static inline size_t setbits16(uint64_t val) {
     return __popcnt64(val);
 }
 
 #elif defined(__GNUC__)
-static size_t topbit(uint64_t val) {
+static inline size_t topbit(uint64_t val) {
     return 63 - __builtin_clzll(val);
 }
 
-static size_t setbits16(uint64_t val) {
+static inline size_t setbits16(uint64_t val) {
     return __builtin_popcountll(val);
 }
 
 #else // no builtins, portable C
 // blog2 of val, result is undefined for val == 0
-static size_t topbit(uint64_t v) {
+static inline size_t topbit(uint64_t v) {
     size_t r, t;
     r = size_t(0 != (v >> 32)) << 5; v >>= r;
     t = size_t(0 != (v >> 16)) << 4; v >>= t; r |= t;
@@ -73,12 +76,119 @@ static inline size_t nbits(uint8_t v) {
     return ((((v - ((v >> 1) & 0x55u)) * 0x1010101u) & 0x30c00c03u) * 0x10040041u) >> 0x1cu;
 }
 
-static size_t setbits16(uint64_t val) {
+static inline size_t setbits16(uint64_t val) {
     return nbits(0xff & val) + nbits(0xff & (val >> 8));
 }
 
 #endif
 
+// Compile time tables
+// Index sequence 0 to N-1, built with log N template depth
+template<size_t... I> struct iseq {};
+template<typename A, typename B> struct iseq_cat;
+template<size_t... I, size_t... J> struct iseq_cat<iseq<I...>, iseq<J...>> {
+    typedef iseq<I..., (sizeof...(I) + J)...> type;
+};
+template<size_t N> struct make_iseq :
+    iseq_cat<typename make_iseq<N / 2>::type, typename make_iseq<N - N / 2>::type> {};
+template<> struct make_iseq<0> { typedef iseq<> type; };
+template<> struct make_iseq<1> { typedef iseq<0> type; };
+
+// Table of G::size values, v[i] = G::get(i), evaluated by the compiler
+template<typename G, typename S = typename make_iseq<G::size>::type> struct ctable;
+template<typename G, size_t... I> struct ctable<G, iseq<I...>> {
+    static constexpr typename G::type v[sizeof...(I)] = { G::get(I)... };
+};
+template<typename G, size_t... I>
+constexpr typename G::type ctable<G, iseq<I...>>::v[sizeof...(I)];
+
+// Hardware CRC32C
+// On x86_64 the sse4.2 target is set on the function itself, clang ignores the target pragma above
+#if (defined(__GNUC__) && defined(__x86_64__)) || defined(_M_X64)
+#define QB3_CRC32C_SSE
+#include <nmmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define QB3_CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define QB3_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+#if !defined(QB3_CRC32C_TARGET)
+#define QB3_CRC32C_TARGET
+#endif
+
+// CRC32C (Castagnoli) of len bytes, continuing from crc, start with crc = 0
+// Uses the crc32 instructions when available
+QB3_CRC32C_TARGET static inline uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    crc = ~crc;
+#if defined(QB3_CRC32C_SSE)
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = static_cast<uint32_t>(c);
+    for (; len; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+#elif defined(QB3_CRC32C_ARM)
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; len; len--)
+        crc = __crc32cb(crc, *p++);
+#else
+    static const struct crc_table {
+        uint32_t v[256];
+        crc_table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c >> 1) ^ (0x82f63b78u & (0 - (c & 1)));
+                v[i] = c;
+            }
+        }
+    } table;
+    for (; len; len--)
+        crc = table.v[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+// Floating point values are encoded as integers of the same size, with an order preserving mapping
+// Negative values have the magnitude bits flipped, which makes them signed integers in value order
+// The mapping is its own inverse
+template<typename T>
+static T fmap(T v) {
+    return v ^ ((T(0) - (v >> (8 * sizeof(T) - 1))) >> 1);
+}
+
+// Core band of band c in the default layout of nb bands
+// For 3 or 4 bands it is RGB(A), with R-G and B-G, otherwise bands are independent
+constexpr size_t default_cband(size_t nb, size_t c) {
+    return ((3 == nb || 4 == nb) && (0 == c || 2 == c)) ? 1 : c;
+}
+
+// Is the core band map the default one for nb bands
+template<typename C>
+static bool is_default_cband(size_t nb, const C* cband) {
+    for (size_t c = 0; c < nb; c++)
+        if (cband[c] != default_cband(nb, c))
+            return false;
+    return true;
+}
+
+// Encoders and decoder are specialized for the default layouts of 1 to 4 bands
+// Template parameter NB is the number of bands, or 0 for any band count and core band map
+constexpr size_t QB3_FIXED_BANDS(4);
+
+// Largest width or height, 2^32. Sizes above 65536 need the wide main header
+constexpr size_t QB3_MAXSIZE(0x100000000ull);
+
 struct band_state {
     size_t prev, runbits, cf;
 };
@@ -89,17 +199,33 @@ struct encs {
     size_t ysize;
     size_t nbands;
     size_t quanta;
+    // Quantization reciprocal, division is a multiply-high and a shift
+    uint64_t qmagic;
+    size_t qshift;
 
     // Persistent state by band
-    band_state band[QB3_MAXBANDS];
+    std::vector<band_state> band;
     // band which will be subtracted, by band
-    size_t cband[QB3_MAXBANDS];
+    std::vector<size_t> cband;
 
     int error; // Holds the code for error, 0 if everything is fine
 
     qb3_mode mode;
     qb3_dtype type;
     bool away; // Round up instead of down when quantizing
+    bool overview; // Write the overview chunk
+    bool crc; // Write the checksum chunk
+
+    // Interleaved data streams and their encoded sizes in bytes
+    size_t nstreams;
+    size_t ssize[QB3_MAXSTREAMS];
+
+    // NoData value bits, pixels where all the bands have this value are masked
+    uint64_t nodata;
+    bool has_nodata;
+    // Valid pixel mask and the mask chunks payload, only set during encoding, if there are masked pixels
+    const BMap* mask;
+    const std::vector<uint8_t>* mask_payload;
 };
 
 // Decoder control structure
@@ -112,17 +238,47 @@ struct decs {
     int stage;
 
     // band which will be added, by band
-    uint8_t cband[QB3_MAXBANDS];
+    std::vector<uint8_t> cband;
     qb3_mode mode;
     qb3_dtype type;
 
     // Input buffer
     uint8_t* s_in;
     size_t s_size;
+
+    // Overview chunk payload, if present
+    uint8_t* ov_in;
+    size_t ov_size;
+
+    // Interleaved data streams, the size of the last one is not stored
+    size_t nstreams;
+    size_t ssize[QB3_MAXSTREAMS];
+
+    // Checksums, if present
+    uint32_t data_crc, raster_crc;
+    bool has_crc, has_raster_crc;
+    bool verify; // Check the checksums when decoding
+
+    // Output conversion
+    qb3_dtype otype;
+    double scale, offset;
+    double alpha;
+    bool convert; // Set if any output conversion is needed
+    bool swap;
+    bool has_alpha;
+
+    // NoData mask, the masked pixels are decoded as the nodata value
+    uint64_t nodata; // Value bits
+    bool has_nodata;
+    BMap mask;
+
+    // Output line callback, only set during qb3_read_lines
+    qb3_put_lines lines_fn;
+    void* lines_ctx;
 };
 
-// in decode.cpp
-extern const int typesizes[8];
+// in encode.cpp
+extern const int typesizes[10];
 
 // Encode integers as magnitude and sign, with bit 0 for sign.
 // This encoding has the top bits always zero, regardless of sign
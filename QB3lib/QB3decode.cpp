@@ -20,6 +20,9 @@ Contributors:  Lucian Plesea
 // For memset, memcpy
 #include <cstring>
 #include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
 
 // Main header
 // 4 sig
@@ -29,15 +32,29 @@ Contributors:  Lucian Plesea
 // 1 data type
 // 1 mode
 constexpr size_t QB3_HDRSZ = 4 + 2 + 2 + 1 + 1 + 1;
+// The wide header, signature "QB3\201", has 4 byte xsize and ysize
+constexpr size_t QB3_WIDE_HDRSZ = QB3_HDRSZ + 4;
 
 void qb3_destroy_decoder(decsp p) {
     delete p;
 }
 
-size_t qb3_decoded_size(const decsp p) {
+// Size of the encoded raster, in bytes
+static size_t raw_size(const decsp p) {
     return p->xsize * p->ysize * p->nbands * typesizes[static_cast<int>(p->type)];
 }
 
+size_t qb3_decoded_size(const decsp p) {
+    return p->xsize * p->ysize * (p->nbands + p->has_alpha) * typesizes[static_cast<int>(p->otype)];
+}
+
+size_t qb3_decimated_size(const decsp p, size_t factor) {
+    if (factor == 0)
+        return 0;
+    return ((p->xsize + factor - 1) / factor) * ((p->ysize + factor - 1) / factor)
+        * (p->nbands + p->has_alpha) * typesizes[static_cast<int>(p->otype)];
+}
+
 qb3_dtype qb3_get_type(const decsp p) {
     return p->type;
 }
@@ -54,6 +71,40 @@ size_t qb3_get_quanta(const decsp p) {
     return p->quanta;
 }
 
+size_t qb3_get_streams(const decsp p) {
+    if (p->stage != 2)
+        return 0; // Error
+    return p->nstreams;
+}
+
+// The nodata value bits, as type T
+template<typename T>
+static double nodata_value(uint64_t bits) {
+    T v;
+    memcpy(&v, &bits, sizeof(T));
+    return static_cast<double>(v);
+}
+
+bool qb3_get_nodata(const decsp p, double* value) {
+    if (p->stage != 2 || !p->has_nodata)
+        return false;
+    switch (p->type) {
+#define X(D, T) case qb3_dtype::D: *value = nodata_value<T>(p->nodata); break
+        X(QB3_U8, uint8_t);
+        X(QB3_I8, int8_t);
+        X(QB3_U16, uint16_t);
+        X(QB3_I16, int16_t);
+        X(QB3_U32, uint32_t);
+        X(QB3_I32, int32_t);
+        X(QB3_U64, uint64_t);
+        X(QB3_I64, int64_t);
+        X(QB3_F32, float);
+        X(QB3_F64, double);
+#undef X
+    }
+    return true;
+}
+
 bool qb3_get_coreband(const decsp p, size_t *coreband) {
     if (p->stage != 2)
         return false; // Error
@@ -62,20 +113,35 @@ bool qb3_get_coreband(const decsp p, size_t *coreband) {
     return true;
 }
 
-// Integer multiply but don't overflow, at least on the positive side
-template<typename T>
-static void dequantize(T* d, const decsp p) {
-    size_t sz = qb3_decoded_size(p) / sizeof(T);
-    const T q = static_cast<T>(p->quanta);
-    const T mai = std::numeric_limits<T>::max() / q; // Top valid value
-    const T mii = std::numeric_limits<T>::min() / q; // Bottom valid value
-    for (size_t i = 0; i < sz; i++) {
-        auto data = d[i];
-        d[i] = (data <= mai) * (data * q) 
-            + (!(data <= mai)) * std::numeric_limits<T>::max();
-        if (std::is_signed<T>() && q > 2 && (data < mii))
-            d[i] = std::numeric_limits<T>::min();
-    }
+// Output conversion is needed if anything is different from the decoded raster
+static void check_convert(decsp p) {
+    p->convert = p->otype != p->type || p->scale != 1.0 || p->offset != 0.0
+        || p->swap || p->has_alpha;
+}
+
+bool qb3_set_decoder_output(decsp p, qb3_dtype dt, double scale, double offset) {
+    if (dt > qb3_dtype::QB3_F64 || !std::isfinite(scale) || !std::isfinite(offset))
+        return false;
+    p->otype = dt;
+    p->scale = scale;
+    p->offset = offset;
+    check_convert(p);
+    return true;
+}
+
+void qb3_set_decoder_swap(decsp p, bool swap) {
+    p->swap = swap;
+    check_convert(p);
+}
+
+void qb3_set_decoder_alpha(decsp p, double value) {
+    p->has_alpha = true;
+    p->alpha = value;
+    check_convert(p);
+}
+
+void qb3_set_decoder_verify(decsp p, bool verify) {
+    p->verify = verify;
 }
 
 // Check a 2 byte signature
@@ -92,15 +158,16 @@ decsp qb3_read_start(void* source, size_t source_size, size_t *image_size) {
     if (source_size < QB3_HDRSZ + 4 || nullptr == image_size)
         return nullptr; // Too short to be a QB3 format stream
     iBits s(reinterpret_cast<uint8_t*>(source), source_size);
-    auto val = s.pull(64);
-    if (!check_sig(val, "QB") || !check_sig(val >> 16, "3\200"))
+    auto val = s.pull(32);
+    const bool wide = check_sig(val >> 16, "3\201");
+    if (!check_sig(val, "QB") || !(wide || check_sig(val >> 16, "3\200")))
+        return nullptr;
+    const size_t hdrsz = wide ? QB3_WIDE_HDRSZ : QB3_HDRSZ;
+    if (source_size < hdrsz + 4)
         return nullptr;
-    auto p = new decs;
-    memset(p, 0, sizeof(decs));
-    val >>= 32;
-    p->xsize = 1 + (val & 0xffff);
-    val >>= 16;
-    p->ysize = 1 + (val & 0xffff);
+    auto p = new decs(); // Zero initialized
+    p->xsize = 1 + s.pull(wide ? 32 : 16);
+    p->ysize = 1 + s.pull(wide ? 32 : 16);
     val = s.peek();
     p->nbands = 1 + (val & 0xff);
     val >>= 8; // Got 56 bits left
@@ -113,12 +180,20 @@ decsp qb3_read_start(void* source, size_t source_size, size_t *image_size) {
     if (p->nbands > QB3_MAXBANDS 
         || (p->mode > qb3_mode::QB3M_BEST && p->mode != qb3_mode::QB3M_STORED)
         || 0 != (val & 0x8080) 
-        || p->type > qb3_dtype::QB3_I64) {
+        || p->type > qb3_dtype::QB3_F64) {
         delete p;
         return nullptr;
     }
-    p->s_in = static_cast<uint8_t*>(source) + QB3_HDRSZ;
-    p->s_size = source_size - QB3_HDRSZ;
+    p->s_in = static_cast<uint8_t*>(source) + hdrsz;
+    p->s_size = source_size - hdrsz;
+    // Identity band mapping, unless there is a CB chunk
+    p->cband.resize(p->nbands);
+    for (size_t c = 0; c < p->nbands; c++)
+        p->cband[c] = static_cast<uint8_t>(c);
+    p->nstreams = 1;
+    // No output conversion
+    p->otype = p->type;
+    p->scale = 1.0;
 
     // Pass back the image size
     image_size[0] = p->xsize;
@@ -130,6 +205,20 @@ decsp qb3_read_start(void* source, size_t source_size, size_t *image_size) {
     return p; // Looks reasonable
 }
 
+// The mask chunks payload is the nodata value followed by the packed mask
+static bool read_mask(decsp p, const std::vector<uint8_t>& payload) {
+    const size_t vsize = typesizes[p->type];
+    if (payload.size() <= vsize)
+        return false;
+    p->nodata = 0;
+    memcpy(&p->nodata, payload.data(), vsize);
+    p->mask = BMap(p->xsize, p->ysize);
+    iBits s(payload.data() + vsize, payload.size() - vsize);
+    p->mask.unpack(s);
+    p->has_nodata = !s.overrun();
+    return p->has_nodata;
+}
+
 // read the rest of the qb3 stream metadata
 // Returns true if no failure is detected and (first) IDAT is found
 bool qb3_read_info(decsp p) {
@@ -141,6 +230,7 @@ bool qb3_read_info(decsp p) {
     }
 
     iBits s(p->s_in, p->s_size);
+    std::vector<uint8_t> mask_payload; // Concatenated from all the mask chunks
     // Need to parse the headers
     do {
         auto val = s.peek();
@@ -172,13 +262,69 @@ bool qb3_read_info(decsp p) {
                 if (p->cband[i] >= p->nbands)
                     p->error = QB3E_EINV;
             }
-            // Should we check the mapping?
+            // Bands are restored in order, a later band used as reference has to be a core band
+            // and an earlier band used as reference can't be derived from a later band
+            for (size_t i = 0; !p->error && i < p->nbands; i++)
+                if ((p->cband[i] > i && p->cband[p->cband[i]] != p->cband[i])
+                    || (p->cband[i] < i && p->cband[p->cband[i]] > p->cband[i]))
+                    p->error = QB3E_EINV;
+        }
+        else if (check_sig(chunk, "OV")) { // Overview
+            s.advance(16 + 16); // CHUNK + LEN
+            // Level and at least a QB3 header
+            if (len < 1 + QB3_HDRSZ + 2 || s.avail() < len * 8u) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            p->ov_in = p->s_in + s.position() / 8;
+            p->ov_size = len;
+            s.advance(len * 8);
+        }
+        else if (check_sig(chunk, "MS")) { // Stream sizes
+            s.advance(16 + 16); // CHUNK + LEN
+            if (len < 1 + 8 || s.avail() < len * 8u) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            p->nstreams = s.pull(8);
+            if (p->nstreams < 2 || p->nstreams > QB3_MAXSTREAMS || len != 1 + 8 * (p->nstreams - 1)) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            for (size_t k = 0; k + 1 < p->nstreams; k++)
+                p->ssize[k] = s.pull(64);
+        }
+        else if (check_sig(chunk, "CR")) { // Checksums
+            s.advance(16 + 16); // CHUNK + LEN
+            if ((len != 4 && len != 8) || s.avail() < len * 8u) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            p->data_crc = static_cast<uint32_t>(s.pull(32));
+            p->has_crc = true;
+            if (len == 8) {
+                p->raster_crc = static_cast<uint32_t>(s.pull(32));
+                p->has_raster_crc = true;
+            }
+        }
+        else if (check_sig(chunk, "NM")) { // NoData mask, the payload can span multiple chunks
+            s.advance(16 + 16); // CHUNK + LEN
+            if (s.avail() < len * 8u) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            const uint8_t* payload = p->s_in + s.position() / 8;
+            mask_payload.insert(mask_payload.end(), payload, payload + len);
+            s.advance(len * 8);
         }
         else if (check_sig(chunk, "DT")) {
             s.advance(16);
             // Update the position
             size_t used = s.position() / 8;
-            if (p->s_size > used) { // Should have some data
+            if (!mask_payload.empty() && !read_mask(p, mask_payload))
+                p->error = QB3E_EINV;
+            // Should have some data, unless all the pixels are masked
+            else if (p->s_size > used || (p->has_nodata && p->s_size == used)) {
                 p->s_in += used;
                 p->s_size -= used;
                 p->stage = 2; // Seen data header
@@ -193,6 +339,50 @@ bool qb3_read_info(decsp p) {
     return QB3E_OK == p->error;
 }
 
+// Decoder for the overview stream, with the same output conversion as p
+static decsp overview_decoder(const decsp p) {
+    if (p->stage != 2 || !p->ov_in)
+        return nullptr;
+    size_t image_size[3];
+    auto ov = qb3_read_start(p->ov_in + 1, p->ov_size - 1, image_size);
+    if (!ov)
+        return nullptr;
+    if (!qb3_read_info(ov) || ov->nbands != p->nbands || ov->type != p->type) {
+        qb3_destroy_decoder(ov);
+        return nullptr;
+    }
+    ov->otype = p->otype;
+    ov->scale = p->scale;
+    ov->offset = p->offset;
+    ov->alpha = p->alpha;
+    ov->swap = p->swap;
+    ov->has_alpha = p->has_alpha;
+    ov->convert = p->convert;
+    return ov;
+}
+
+size_t qb3_overview_size(const decsp p, size_t* image_size) {
+    auto ov = overview_decoder(p);
+    if (!ov)
+        return 0;
+    image_size[0] = ov->xsize;
+    image_size[1] = ov->ysize;
+    image_size[2] = ov->nbands;
+    image_size[3] = size_t(1) << p->ov_in[0];
+    auto len = qb3_decoded_size(ov);
+    qb3_destroy_decoder(ov);
+    return len;
+}
+
+size_t qb3_read_overview(decsp p, void* destination) {
+    auto ov = overview_decoder(p);
+    if (!ov)
+        return 0;
+    auto len = qb3_read_data(ov, destination);
+    qb3_destroy_decoder(ov);
+    return len;
+}
+
 // Decode RLE0FFFF data
 // Returns 0 if decoding worked as expected
 int64_t deRLE0FFFF(const uint8_t* s, size_t slen, uint8_t* d, size_t dlen) {
@@ -268,28 +458,326 @@ size_t deRLE0FFFFSize(const uint8_t* s, size_t slen) {
     return count;
 }
 
+// Integer to integer, saturated to the output range
+template<typename D, typename S>
+static D sat_cast(S v) {
+    static_assert(std::is_integral<D>() && std::is_integral<S>(), "Integer types only");
+    if (std::is_signed<S>() && v < S(0)) {
+        if (!std::is_signed<D>() 
+            || static_cast<int64_t>(v) < static_cast<int64_t>(std::numeric_limits<D>::min()))
+            return std::numeric_limits<D>::min();
+        return static_cast<D>(v);
+    }
+    if (static_cast<uint64_t>(v) > static_cast<uint64_t>(std::numeric_limits<D>::max()))
+        return std::numeric_limits<D>::max();
+    return static_cast<D>(v);
+}
+
+// Double to integer, rounded to nearest and saturated to the output range
+template<typename D>
+static typename std::enable_if<std::is_integral<D>::value, D>::type to_type(double v) {
+    v = std::round(v);
+    if (!(v > static_cast<double>(std::numeric_limits<D>::min()))) // Includes NaN
+        return (v != v) ? D(0) : std::numeric_limits<D>::min();
+    // max() + 1 is a power of two, exact as a double
+    if (v >= 2.0 * static_cast<double>(std::numeric_limits<D>::max() / 2 + 1))
+        return std::numeric_limits<D>::max();
+    return static_cast<D>(v);
+}
+
+template<typename D>
+static typename std::enable_if<std::is_floating_point<D>::value, D>::type to_type(double v) {
+    return static_cast<D>(v);
+}
+
+// Value of type S with the same bits as v, for floating point values
+template<typename S, typename T>
+static S as(T v) {
+    static_assert(sizeof(S) == sizeof(T), "Size mismatch");
+    S s;
+    memcpy(&s, &v, sizeof(S));
+    return s;
+}
+
+// Reverse the bytes of a value, compiles to a single instruction
+template<typename D>
+static D bswap(D v) {
+    uint8_t b[sizeof(D)];
+    memcpy(b, &v, sizeof(D));
+    std::reverse(b, b + sizeof(D));
+    memcpy(&v, b, sizeof(D));
+    return v;
+}
+
+// Adds the alpha band and swaps the bytes of an output line, as needed
+template<typename D>
+static void finish_line(D* d, size_t xsize, size_t bands, size_t obands, D alpha, bool swap) {
+    if (obands != bands)
+        for (D* o = d + bands; o < d + xsize * obands; o += obands)
+            *o = alpha;
+    if (swap && sizeof(D) > 1)
+        for (D* o = d; o < d + xsize * obands; o++)
+            *o = bswap(*o);
+}
+
+// Converts each decoded strip into the output format, while it is still in cache
+// With a factor above 1, the output is decimated, each output value is the mean of the
+// factor by factor input values it covers, or fewer at the right and bottom edges
+// If the line callback is set, the output lines are passed to it instead of being written to destination
+// T is the decoded type, S is the type of the encoded values and D is the output type
+template<typename T, typename S, typename D>
+struct convert_sink : QB3::sink<T> {
+    convert_sink(const decsp p, void* destination, size_t factor = 1) :
+        xsize(p->xsize), ysize(p->ysize), bands(p->nbands), obands(p->nbands + p->has_alpha),
+        factor(factor), oxsize((p->xsize + factor - 1) / factor), next(0),
+        scale(p->scale), offset(p->offset), alpha(to_type<D>(p->alpha)), swap(p->swap),
+        direct(std::is_integral<D>() && p->scale == 1.0 && p->offset == 0.0),
+        buffer(B * p->xsize * p->nbands), sums(factor > 1 ? oxsize * p->nbands : 0),
+        mask(factor > 1 && p->has_nodata ? &p->mask : nullptr), nodata(static_cast<T>(p->nodata)),
+        counts(mask ? oxsize : 0),
+        dest(reinterpret_cast<D*>(destination)), fn(p->lines_fn), ctx(p->lines_ctx),
+        lines(fn ? (factor > 1 ? oxsize : B * xsize) * obands : 0) {}
+
+    T* strip(size_t) { return buffer.data(); }
+
+    bool put(size_t y) {
+        if (factor > 1)
+            return decimate(y);
+        const T* src = buffer.data();
+        for (size_t line = 0; line < B; line++) {
+            D* const d = fn ? lines.data() + line * xsize * obands : dest + ((y + line) * xsize) * obands;
+            D* o = d;
+            if (direct) {
+                for (size_t x = 0; x < xsize; x++, o += obands, src += bands)
+                    for (size_t c = 0; c < bands; c++)
+                        o[c] = conv(as<S>(src[c]));
+            }
+            else {
+                for (size_t x = 0; x < xsize; x++, o += obands, src += bands)
+                    for (size_t c = 0; c < bands; c++)
+                        o[c] = to_type<D>(as<S>(src[c]) * scale + offset);
+            }
+            finish_line(d, xsize, bands, obands, alpha, swap);
+        }
+        if (fn) { // Only the lines not passed already
+            const size_t first = std::max(y, next);
+            next = y + B;
+            return fn(ctx, first, y + B - first, lines.data() + (first - y) * xsize * obands);
+        }
+        return true;
+    }
+
+private:
+    // Accumulate the strip lines into the output line sums
+    // Lines already seen, from the overlapping last strip, are skipped
+    // With a mask, only the valid pixels are used, outputs with no valid pixels are nodata
+    bool decimate(size_t y) {
+        for (size_t line = 0; line < B; line++) {
+            const size_t row = y + line;
+            if (row < next)
+                continue;
+            const T* src = buffer.data() + line * xsize * bands;
+            for (size_t ox = 0, x = 0; ox < oxsize; ox++) {
+                double* const sum = sums.data() + ox * bands;
+                for (const size_t xe = std::min(x + factor, xsize); x < xe; x++, src += bands) {
+                    if (mask) {
+                        if (!mask->bit(x, row))
+                            continue;
+                        counts[ox]++;
+                    }
+                    for (size_t c = 0; c < bands; c++)
+                        sum[c] += static_cast<double>(as<S>(src[c]));
+                }
+            }
+            next = row + 1;
+            if (next % factor && next != ysize)
+                continue;
+            // Last input line of an output line
+            const size_t oy = row / factor;
+            const double ny = static_cast<double>(next - oy * factor);
+            D* const d = fn ? lines.data() : dest + oy * oxsize * obands;
+            for (size_t ox = 0; ox < oxsize; ox++) {
+                const double n = mask ? static_cast<double>(counts[ox])
+                    : ny * static_cast<double>(std::min(factor, xsize - ox * factor));
+                for (size_t c = 0; c < bands; c++)
+                    d[ox * obands + c] = n ? to_type<D>(sums[ox * bands + c] / n * scale + offset)
+                    : to_type<D>(static_cast<double>(as<S>(nodata)) * scale + offset);
+            }
+            finish_line(d, oxsize, bands, obands, alpha, swap);
+            if (fn && !fn(ctx, oy, 1, d))
+                return false;
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(counts.begin(), counts.end(), 0);
+        }
+        return true;
+    }
+
+    // No scaling, integer to integer is saturated, floating point to integer is also rounded
+    template<typename V = D>
+    typename std::enable_if<std::is_integral<V>::value && std::is_integral<S>::value, V>::type
+        conv(S v) { return sat_cast<D>(v); }
+    template<typename V = D>
+    typename std::enable_if<!(std::is_integral<V>::value && std::is_integral<S>::value), V>::type
+        conv(S v) { return to_type<D>(v); }
+
+    const size_t xsize, ysize, bands, obands;
+    const size_t factor, oxsize;
+    size_t next; // Next input line, when decimating
+    const double scale, offset;
+    const D alpha;
+    const bool swap, direct;
+    std::vector<T> buffer;
+    std::vector<double> sums; // Output line sums, when decimating
+    const BMap* const mask; // Valid pixels, when decimating with nodata
+    const T nodata;
+    std::vector<size_t> counts; // Valid pixels in the output line sums
+    D* const dest;
+    const qb3_put_lines fn;
+    void* const ctx;
+    std::vector<D> lines; // Output lines, for the callback
+};
+
+// Feeds raw values to a sink, one strip at a time
+template<typename T>
+static bool stored_decode(const uint8_t* src, QB3::sink<T>& out, size_t xsize, size_t ysize, size_t bands) {
+    const size_t linesize = xsize * bands * sizeof(T);
+    for (size_t y = 0; y < ysize; y += B) {
+        if (y + B > ysize)
+            y = ysize - B;
+        memcpy(out.strip(y), src + y * linesize, B * linesize);
+        if (!out.put(y))
+            return true;
+    }
+    return false;
+}
+
+// Checksum of the decoded raster, passes the strips to another sink
+// The last strip overlaps the previous one, each line is only included once
+template<typename T>
+struct crc_sink : QB3::sink<T> {
+    crc_sink(QB3::sink<T>& out, size_t linesize) :
+        crc(0), out(out), linesize(linesize), next(0), buffer(nullptr) {}
+
+    T* strip(size_t y) { return buffer = out.strip(y); }
+
+    bool put(size_t y) {
+        const size_t first = std::max(y, next);
+        crc = crc32c(crc, buffer + (first - y) * linesize, (y + B - first) * linesize * sizeof(T));
+        next = y + B;
+        return out.put(y);
+    }
+
+    uint32_t crc;
+
+private:
+    QB3::sink<T>& out;
+    const size_t linesize; // in values
+    size_t next; // First line not in the checksum
+    T* buffer;
+};
+
+// Decode using the code specialized for the band layout, when there is one
+template<typename T>
+static bool band_decode(decsp p, uint8_t* src, size_t len, QB3::sink<T>& out) {
+    if (is_default_cband(p->nbands, p->cband.data()))
+        switch (p->nbands) {
+        case 1: return QB3::decode<T, false, 1>(src, len, out, *p);
+        case 2: return QB3::decode<T, false, 2>(src, len, out, *p);
+        case 3: return QB3::decode<T, false, 3>(src, len, out, *p);
+        case 4: return QB3::decode<T, false, 4>(src, len, out, *p);
+        }
+    return QB3::decode(src, len, out, *p);
+}
+
+// Decode into a sink, returns true on failure
+template<typename T>
+static bool sink_decode(decsp p, uint8_t* src, size_t len, QB3::sink<T>& out) {
+    // Stored data is never quantized
+    if (p->mode == qb3_mode::QB3M_STORED)
+        return stored_decode(src, out, p->xsize, p->ysize, p->nbands);
+    return band_decode(p, src, len, out);
+}
+
+// Same, also checks the raster checksum if needed
+template<typename T>
+static bool verify_decode(decsp p, uint8_t* src, size_t len, QB3::sink<T>& out) {
+    if (!p->verify || !p->has_raster_crc)
+        return sink_decode(p, src, len, out);
+    crc_sink<T> cout(out, p->xsize * p->nbands);
+    return sink_decode(p, src, len, cout) || cout.crc != p->raster_crc;
+}
+
+// Decode with output conversion, returns true on failure
+template<typename T, typename S, typename D>
+static bool convert_decode(decsp p, uint8_t* src, size_t len, void* destination, size_t factor) {
+    convert_sink<T, S, D> out(p, destination, factor);
+    return verify_decode(p, src, len, out);
+}
+
+template<typename T, typename S>
+static bool convert_decode(decsp p, uint8_t* src, size_t len, void* destination, size_t factor) {
+    switch (p->otype) {
+#define CDEC(D) return convert_decode<T, S, D>(p, src, len, destination, factor)
+    case qb3_dtype::QB3_U8:  CDEC(uint8_t);
+    case qb3_dtype::QB3_I8:  CDEC(int8_t);
+    case qb3_dtype::QB3_U16: CDEC(uint16_t);
+    case qb3_dtype::QB3_I16: CDEC(int16_t);
+    case qb3_dtype::QB3_U32: CDEC(uint32_t);
+    case qb3_dtype::QB3_I32: CDEC(int32_t);
+    case qb3_dtype::QB3_U64: CDEC(uint64_t);
+    case qb3_dtype::QB3_I64: CDEC(int64_t);
+    case qb3_dtype::QB3_F32: CDEC(float);
+    case qb3_dtype::QB3_F64: CDEC(double);
+#undef CDEC
+    default:
+        return true; // Invalid type
+    }
+}
+
+// Decode in place, returns true on failure
+template<typename T>
+static bool fast_decode(decsp p, uint8_t* src, size_t len, T* image) {
+    QB3::image_sink<T> out(image, p->xsize * p->nbands);
+    if (!p->verify || !p->has_raster_crc)
+        return band_decode(p, src, len, out);
+    return verify_decode(p, src, len, out);
+}
+
 // returns 0 if an error is detected
 // TODO: Error reporting
-// source points to data to decode
-static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* destination)
+// source points to data to decode, the output is decimated if factor is above 1
+static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* destination, size_t factor = 1)
 {
     int error_code = 0;
     auto src = reinterpret_cast<uint8_t *>(source);
 
+    // Check the data checksum before decoding, so corrupt data doesn't reach the output or the line callback
+    // The decoder reads the streams out of order and the RLE is removed first, the checksum is over the stored bytes
+    if (p->verify && p->has_crc && crc32c(0, src, src_sz) != p->data_crc) {
+        p->error = QB3E_EINV;
+        return 0;
+    }
+
     // If the data is stored and size is right, just copy it
     if (p->mode == qb3_mode::QB3M_STORED) {
         // Only if the size is what we expect
-        if (src_sz != qb3_decoded_size(p)) {
+        if (src_sz != raw_size(p)) {
             p->error = QB3E_EINV;
             return 0;
         }
-        memcpy(destination, source, src_sz);
-        return src_sz;
+        if (!p->convert && factor == 1 && !p->lines_fn) {
+            memcpy(destination, source, src_sz);
+            if (p->verify && p->has_raster_crc && crc32c(0, destination, src_sz) != p->raster_crc) {
+                p->error = QB3E_EINV;
+                return 0;
+            }
+            return src_sz;
+        }
     }
 
     std::vector<uint8_t> buffer;
     // If RLE is needed, it is expensive, allocates a whole new buffer
-    if (p->mode == QB3M_RLE || p->mode == QB3M_CF_RLE) {
+    if ((p->mode == QB3M_RLE || p->mode == QB3M_CF_RLE) && src_sz) {
         // RLE needs to be decoded into a temporary buffer
         auto sz = deRLE0FFFFSize(src, src_sz);
         buffer.resize(sz);
@@ -303,8 +791,27 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* destination
         src_sz = sz;
     }
 
-#define DEC(T) QB3::decode(src, src_sz, reinterpret_cast<T*>(destination), \
-    p->xsize, p->ysize, p->nbands, p->cband)
+    if (p->convert || factor > 1 || p->lines_fn) {
+        switch (p->type) {
+#define CDEC(T, S) error_code = convert_decode<T, S>(p, src, src_sz, destination, factor); break
+        case qb3_dtype::QB3_U8:  CDEC(uint8_t, uint8_t);
+        case qb3_dtype::QB3_I8:  CDEC(uint8_t, int8_t);
+        case qb3_dtype::QB3_U16: CDEC(uint16_t, uint16_t);
+        case qb3_dtype::QB3_I16: CDEC(uint16_t, int16_t);
+        case qb3_dtype::QB3_U32: CDEC(uint32_t, uint32_t);
+        case qb3_dtype::QB3_I32: CDEC(uint32_t, int32_t);
+        case qb3_dtype::QB3_U64: CDEC(uint64_t, uint64_t);
+        case qb3_dtype::QB3_I64: CDEC(uint64_t, int64_t);
+        case qb3_dtype::QB3_F32: CDEC(uint32_t, float);
+        case qb3_dtype::QB3_F64: CDEC(uint64_t, double);
+#undef CDEC
+        default:
+            error_code = 3; // Invalid type
+        }
+        return error_code ? 0 : qb3_decimated_size(p, factor);
+    }
+
+#define DEC(T) fast_decode(p, src, src_sz, reinterpret_cast<T*>(destination))
 
     switch (p->type) {
     case qb3_dtype::QB3_U8:
@@ -315,52 +822,113 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* destination
         error_code = DEC(uint16_t); break;
     case qb3_dtype::QB3_U32:
     case qb3_dtype::QB3_I32:
+    case qb3_dtype::QB3_F32:
         error_code = DEC(uint32_t); break;
     case qb3_dtype::QB3_U64:
     case qb3_dtype::QB3_I64:
+    case qb3_dtype::QB3_F64:
         error_code = DEC(uint64_t); break;
     default:
         error_code = 3; // Invalid type
     } // data type
 #undef DEC
-
-#define MUL(T) dequantize(reinterpret_cast<T *>(destination), p)
-    // We have a quanta, decode in place
-    if (!error_code && p->quanta > 1) {
-        switch (p->type) {
-        case qb3_dtype::QB3_I8:
-            MUL(int8_t); break;
-        case qb3_dtype::QB3_U8:
-            MUL(uint8_t); break;
-        case qb3_dtype::QB3_I16:
-            MUL(int16_t); break;
-        case qb3_dtype::QB3_U16:
-            MUL(uint16_t); break;
-        case qb3_dtype::QB3_I32:
-            MUL(int32_t); break;
-        case qb3_dtype::QB3_U32:
-            MUL(uint32_t); break;
-        case qb3_dtype::QB3_I64:
-            MUL(int64_t); break;
-        case qb3_dtype::QB3_U64:
-            MUL(uint64_t); break;
-        default:
-            error_code = 3; // Invalid type
-        } // data type
-
-    }
-#undef MUL
     return error_code ? 0 : qb3_decoded_size(p);
 }
 
+// The data is empty only when all the pixels are masked
+static bool has_data(const decsp p) {
+    return p->s_in != nullptr && (p->s_size != 0 || p->has_nodata);
+}
+
 // Call after read_header to read the actual data
 size_t qb3_read_data(decsp p, void* destination) {
     // Check that it was a QB3 file
     if (p->stage != 2 || p->error != QB3E_OK
-        || p->s_in == nullptr || p->s_size == 0) {
+        || !has_data(p)) {
         if (p->error == QB3E_OK)
             p->error = QB3E_EINV;
         return 0; // Error signal
     }
     return qb3_decode(p, p->s_in, p->s_size, destination);
 }
+
+bool qb3_validate(decsp p) {
+    if (p->stage != 2 || p->error != QB3E_OK
+        || !has_data(p)) {
+        if (p->error == QB3E_OK)
+            p->error = QB3E_EINV;
+        return false;
+    }
+    auto src = p->s_in;
+    auto src_sz = p->s_size;
+    // A checksum can be recomputed for any data, a match doesn't make the stream valid
+    // The stream is always checked, a checksum mismatch is an additional failure
+    bool failed = p->has_crc && (crc32c(0, src, src_sz) != p->data_crc);
+    std::vector<uint8_t> buffer;
+    if (!failed && p->mode == qb3_mode::QB3M_STORED) {
+        failed = (src_sz != raw_size(p));
+    }
+    else if (!failed) {
+        if ((p->mode == QB3M_RLE || p->mode == QB3M_CF_RLE) && src_sz) {
+            // The RLE has to be undone, this is the only allocation
+            auto sz = deRLE0FFFFSize(src, src_sz);
+            buffer.resize(sz);
+            failed = (0 == sz) || (0 != deRLE0FFFF(src, src_sz, buffer.data(), sz));
+            src = buffer.data();
+            src_sz = sz;
+        }
+        if (!failed) {
+            switch (p->type) {
+#define VAL(T) failed = QB3::validate<T>(src, src_sz, *p); break
+            case qb3_dtype::QB3_U8:
+            case qb3_dtype::QB3_I8:  VAL(uint8_t);
+            case qb3_dtype::QB3_U16:
+            case qb3_dtype::QB3_I16: VAL(uint16_t);
+            case qb3_dtype::QB3_U32:
+            case qb3_dtype::QB3_I32:
+            case qb3_dtype::QB3_F32: VAL(uint32_t);
+            case qb3_dtype::QB3_U64:
+            case qb3_dtype::QB3_I64:
+            case qb3_dtype::QB3_F64: VAL(uint64_t);
+#undef VAL
+            default:
+                failed = true; // Invalid type
+            }
+        }
+    }
+    // The overview, if present, has to be valid too
+    if (!failed && p->ov_in) {
+        auto ov = overview_decoder(p);
+        failed = !ov || !qb3_validate(ov);
+        if (ov)
+            qb3_destroy_decoder(ov);
+    }
+    if (failed)
+        p->error = QB3E_EINV;
+    return !failed;
+}
+
+size_t qb3_read_lines(decsp p, size_t factor, qb3_put_lines fn, void* ctx) {
+    if (p->stage != 2 || p->error != QB3E_OK
+        || !has_data(p) || factor == 0 || fn == nullptr) {
+        if (p->error == QB3E_OK)
+            p->error = QB3E_EINV;
+        return 0; // Error signal
+    }
+    p->lines_fn = fn;
+    p->lines_ctx = ctx;
+    auto len = qb3_decode(p, p->s_in, p->s_size, nullptr, factor);
+    p->lines_fn = nullptr;
+    p->lines_ctx = nullptr;
+    return len;
+}
+
+size_t qb3_read_decimated(decsp p, size_t factor, void* destination) {
+    if (p->stage != 2 || p->error != QB3E_OK
+        || !has_data(p) || factor == 0) {
+        if (p->error == QB3E_OK)
+            p->error = QB3E_EINV;
+        return 0; // Error signal
+    }
+    return qb3_decode(p, p->s_in, p->s_size, destination, factor);
+}
@@ -18,16 +18,18 @@ Contributors:  Lucian Plesea
 #pragma warning(disable:4127) // conditional expression is constant
 #include "QB3encode.h"
 #include <limits>
+#include <cmath>
 // For memcpy
 #include <cstring>
 #include <vector>
+#include <algorithm>
 
 // constructor
 encsp qb3_create_encoder(size_t width, size_t height, size_t bands, qb3_dtype dt) {
-    if (width < 4 || width > 0x10000ul 
-        || height < 4 || height > 0x10000ul 
+    if (width < 4 || width > QB3_MAXSIZE 
+        || height < 4 || height > QB3_MAXSIZE 
         || bands == 0 || bands > QB3_MAXBANDS 
-        || dt > int(QB3_I64))
+        || dt > int(QB3_F64))
         return nullptr;
     auto p = new encs;
     p->xsize = width;
@@ -36,14 +38,23 @@ encsp qb3_create_encoder(size_t width, size_t height, size_t bands, qb3_dtype dt
     p->type = static_cast<qb3_dtype>(dt);
     p->quanta = 1; // No quantization
     p->away = false; // Round to zero
+    p->overview = false;
+    p->crc = false;
+    p->nstreams = 1;
+    p->nodata = 0;
+    p->has_nodata = false;
+    p->mask = nullptr;
+    p->mask_payload = nullptr;
     //p->raw = false;  // Write image header
     p->mode = QB3M_DEFAULT; // Base
     // Start with no inter-band differential
+    p->band.resize(bands);
+    p->cband.resize(bands);
     for (size_t c = 0; c < bands; c++) {
         p->band[c].runbits = 0;
         p->band[c].prev = 0;
         p->band[c].cf = 0;
-        p->cband[c] = static_cast<uint8_t>(c);
+        p->cband[c] = c;
     }
     // For 3 or 4 bands we assume RGB(A) input and use R-G and B-G
     if (bands == 3 || bands == 4)
@@ -57,7 +68,7 @@ void qb3_reset_encoder(encsp p) {
         p->band[c].runbits = 0;
         p->band[c].prev = 0;
         p->band[c].cf = 0;
-        p->cband[c] = static_cast<uint8_t>(c);
+        p->cband[c] = c;
     }
     p->error = 0;
 }
@@ -71,10 +82,16 @@ bool qb3_set_encoder_coreband(encsp p, size_t bands, size_t *cband) {
         return false; // Incorrect band number
     // Set it, make sure it's not out of spec
     for (size_t i = 0; i < bands; i++)
-        p->cband[i] = static_cast<uint8_t>((cband[i] < bands) ? cband[i] : i);
-    // Force core bands to be independent
+        p->cband[i] = (cband[i] < bands) ? cband[i] : i;
+    // A band can be derived from any earlier band, which can itself be derived, forming a chain
+    // Force later bands used as references to be core bands
     for (size_t i = 0; i < bands; i++)
-        if (p->cband[i] != i)
+        if (p->cband[i] > i)
+            p->cband[p->cband[i]] = p->cband[i];
+    // An earlier band used as reference can't be derived from a later band, it is restored after the chain
+    // Force it to be a core band
+    for (size_t i = 0; i < bands; i++)
+        if (p->cband[i] < i && p->cband[p->cband[i]] > p->cband[i])
             p->cband[p->cband[i]] = p->cband[i];
     // Return the possibly modified band mapping
     for (size_t i = 0; i < bands; i++)
@@ -82,6 +99,33 @@ bool qb3_set_encoder_coreband(encsp p, size_t bands, size_t *cband) {
     return true;
 }
 
+// floor(hi * 2^64 / d), for hi < d
+static uint64_t div128(uint64_t hi, uint64_t d) {
+    uint64_t q = 0;
+    for (int i = 0; i < 64; i++) {
+        uint64_t carry = hi >> 63;
+        hi <<= 1;
+        q <<= 1;
+        if (carry || hi >= d) {
+            hi -= d;
+            q |= 1;
+        }
+    }
+    return q;
+}
+
+// Reciprocal of the quanta, for values of the encoded type size
+// Same as the libdivide branch-free unsigned division
+// v / d = (t + ((v - t) >> 1)) >> qshift, where t = mulhi(v, qmagic)
+static void set_reciprocal(encsp p) {
+    const size_t bits = 8 * typesizes[p->type];
+    const uint64_t d = p->quanta;
+    const size_t l = topbit(d - 1) + 1; // ceil(log2(d)), d > 1
+    const uint64_t hi = ((l < 64) ? (1ull << l) : 0) - d; // 2^l - d, less than d
+    p->qmagic = 1 + ((bits == 64) ? div128(hi, d) : (hi << bits) / d);
+    p->qshift = l - 1;
+}
+
 // Sets quantization parameters
 // Valid values are 2 and above
 // sign = true when the input data is signed
@@ -113,69 +157,156 @@ bool qb3_set_encoder_quanta(encsp p, size_t q, bool away) {
         error |= TOO_LARGE(p->quanta, uint32_t);
     case qb3_dtype::QB3_I64:
         error |= TOO_LARGE(p->quanta, int64_t);
+    case qb3_dtype::QB3_U64:
+        break;
+    default: // Floating point values are lossless only
+        error = true;
     } // data type
 #undef TOO_LARGE
     if (error)
         p->quanta = 1;
+    else
+        set_reciprocal(p);
     return !error;
 }
 
 // bytes per value by qb3_dtype, keep them in sync
-const int typesizes[8] = { 1, 1, 2, 2, 4, 4, 8, 8 };
+const int typesizes[10] = { 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
 
-size_t qb3_max_encoded_size(const encsp p) {
-    // Pad to 4 x 4
-    size_t nvalues = 16 * ((p->xsize + 3) / 4) * ((p->ysize + 3) / 4) * p->nbands;
+// Upper bound of the encoded size of a number of 4x4 block columns, without the headers
+static size_t max_data_size(const encsp p, size_t columns) {
+    size_t nvalues = 16 * columns * ((p->ysize + 3) / 4) * p->nbands;
     // Maximum expansion is under 17/16 bits per input value, for large number of values
     double bits_per_value = 17.0 / 16.0 + typesizes[static_cast<int>(p->type)] * 8;
     return 1024 + static_cast<size_t>(bits_per_value * nvalues / 8);
 }
 
+// Upper bound of the mask chunks size, the nodata value followed by the packed mask
+static size_t max_mask_size(const encsp p) {
+    if (!p->has_nodata)
+        return 0;
+    size_t len = typesizes[p->type] + (((p->xsize + 7) / 8) * ((p->ysize + 7) / 8) * 66 + 7) / 8;
+    return len + 4 * ((len + 0xfffe) / 0xffff);
+}
+
+size_t qb3_max_encoded_size(const encsp p) {
+    // The overview chunk can't be larger than 64KB
+    return (p->overview ? 0x10004 : 0) + max_mask_size(p) + max_data_size(p, (p->xsize + 3) / 4);
+}
+
+void qb3_set_encoder_overview(encsp p, bool overview) {
+    p->overview = overview;
+}
+
+void qb3_set_encoder_crc(encsp p, bool crc) {
+    p->crc = crc;
+}
+
+size_t qb3_set_encoder_streams(encsp p, size_t n) {
+    if (n >= 1 && n <= QB3_MAXSTREAMS)
+        p->nstreams = std::min(n, (p->xsize + B - 1) / B);
+    return p->nstreams;
+}
+
+// Value bits of v in type T, returns false if v is not valid for T
+// Integer types have to hold v exactly, floating point ones are rounded
+template<typename T>
+static bool value_bits(double v, uint64_t& bits) {
+    typedef std::numeric_limits<T> L;
+    if (L::is_integer && !(v == std::floor(v) && v >= double(L::min()) && v < 2.0 * (double(L::max() / 2) + 1)))
+        return false;
+    if (!L::is_integer && std::isfinite(v) && std::fabs(v) > double(L::max()))
+        return false;
+    T t = static_cast<T>(v);
+    bits = 0;
+    memcpy(&bits, &t, sizeof(T));
+    return true;
+}
+
+bool qb3_set_encoder_nodata(encsp p, bool nodata, double value) {
+    p->has_nodata = false;
+    if (!nodata)
+        return true;
+    switch (p->type) {
+#define X(D, T) case qb3_dtype::D: p->has_nodata = value_bits<T>(value, p->nodata); break
+        X(QB3_U8, uint8_t);
+        X(QB3_I8, int8_t);
+        X(QB3_U16, uint16_t);
+        X(QB3_I16, int16_t);
+        X(QB3_U32, uint32_t);
+        X(QB3_I32, int32_t);
+        X(QB3_U64, uint64_t);
+        X(QB3_I64, int64_t);
+        X(QB3_F32, float);
+        X(QB3_F64, double);
+#undef X
+    }
+    return p->has_nodata;
+}
+
 qb3_mode qb3_set_encoder_mode(encsp p, qb3_mode mode) {
     if (mode <= qb3_mode::QB3M_BEST)
         p->mode = mode;
     return p->mode;
 }
 
-// Round to Zero Division, no overflow
-template<typename T> static T rto0div(T x, T y) {
-    static_assert(std::is_integral<T>(), "Integer types only");
-    T r = x / y, m = x % y;
-    y = (y >> 1);
-    return r + (!(x < 0) & (m > y)) - ((x < 0) & ((m + y) < 0));
+// High half of the product
+template<typename T> static T mulhi(T a, T b) {
+    static_assert(sizeof(T) < 8, "Only types under 64bit");
+    typedef typename std::conditional<sizeof(T) == 4, uint64_t, uint32_t>::type W;
+    return static_cast<T>((static_cast<W>(a) * b) >> (8 * sizeof(T)));
 }
 
-// Round from Zero Division, no overflow
-template<typename T> static T rfr0div(T x, T y) {
-    static_assert(std::is_integral<T>(), "Integer types only");
-    T r = x / y, m = x % y;
-    y = (y >> 1) + (y & 1);
-    return r + (!(x < 0) & (m >= y)) - ((x < 0) & ((m + y) <= 0));
+static uint64_t mulhi(uint64_t a, uint64_t b) {
+#if defined(_WIN32)
+    return __umulh(a, b);
+#elif defined(__GNUC__)
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+#else
+    uint64_t al = a & 0xffffffffull, ah = a >> 32, bl = b & 0xffffffffull, bh = b >> 32;
+    uint64_t mid = ((al * bl) >> 32) + (al * bh & 0xffffffffull) + (ah * bl & 0xffffffffull);
+    return ah * bh + ((al * bh) >> 32) + ((ah * bl) >> 32) + (mid >> 32);
+#endif
 }
 
-// Quantize source, in place
-template<typename T>
-bool quantize(T* source, oBits& , encs& p) {
-    size_t nV = p.xsize * p.ysize * p.nbands; // Number of values
-    T q = static_cast<T>(p.quanta);
-    if (q == 2) { // Easy to optimize for 2, common
-        if (p.away)
-            for (size_t i = 0; i < nV; i++)
-                source[i] = source[i] / 2 + source[i] % 2;
-        else
-            for (size_t i = 0; i < nV; i++)
-                source[i] /= 2;
-        return 0;
+// Quantizer for the group gather, divides and rounds to nearest
+// Half way values are rounded towards zero, or away from zero if AWAY is set
+// Division is a multiply-high with the reciprocal of the quanta, followed by
+// the remainder check for rounding. Branch-free, so the loop vectorizes
+// T is the unsigned type used by the encoder, S has the signedness of the input values
+template<typename T, typename S, bool AWAY>
+struct quantizer {
+    static const bool active = true;
+    quantizer(const encs& p) : q(static_cast<T>(p.quanta)), magic(static_cast<T>(p.qmagic)),
+        half(static_cast<T>(p.quanta / 2 + (AWAY ? (p.quanta & 1) : 0))), shift(p.qshift) {}
+
+    void operator()(const T* src, T* dst, size_t n) const {
+        for (size_t i = 0; i < n; i++) {
+            const T v = src[i];
+            // All bits set for negative values
+            const T neg = static_cast<T>(T(0) - T(std::is_signed<S>::value && static_cast<S>(v) < 0));
+            const T a = static_cast<T>((v ^ neg) - neg); // Absolute value
+            const T t = mulhi(a, magic);
+            T r = static_cast<T>(static_cast<T>(t + static_cast<T>(static_cast<T>(a - t) >> 1)) >> shift);
+            const T m = static_cast<T>(a - r * q); // Remainder
+            r = static_cast<T>(r + (AWAY ? (m >= half) : (m > half)));
+            dst[i] = static_cast<T>((r ^ neg) - neg);
+        }
     }
 
-    if (p.away)
-        for (size_t i = 0; i < nV; i++)
-            source[i] = rfr0div(source[i], q);
-    else
-        for (size_t i = 0; i < nV; i++)
-            source[i] = rto0div(source[i], q);
-    return 0;
-}
+    const T q, magic, half;
+    const size_t shift;
+};
+
+// Floating point value filter, converts the value bits to the order preserving integer mapping
+template<typename T>
+struct floatmap {
+    static const bool active = true;
+    void operator()(const T* src, T* dst, size_t n) const {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = fmap(src[i]);
+    }
+};
 
 // A chunk signature is two characters
 void static push_sig(const char* sig, oBits& s) {
@@ -183,14 +314,16 @@ void static push_sig(const char* sig, oBits& s) {
     s.push(*reinterpret_cast<const uint16_t *>(sig), 16);
 }
 
-// Main header, fixed size
+// Main header, fixed size, 4 bytes larger for the wide header
 // 
 void static write_qb3_header(encsp p, oBits& s) {
     // QB3 signature is 4 bytes
-    s.push(*reinterpret_cast<const uint32_t*>("QB3\200"), 32);
+    // The wide header has 32bit size fields, for sizes above 65536
+    const bool wide = p->xsize > 0x10000 || p->ysize > 0x10000;
+    s.push(*reinterpret_cast<const uint32_t*>(wide ? "QB3\201" : "QB3\200"), 32);
     // Write xmax, ymax, num bands in low endian
-    s.push((p->xsize - 1), 16);
-    s.push((p->ysize - 1), 16);
+    s.push((p->xsize - 1), wide ? 32 : 16);
+    s.push((p->ysize - 1), wide ? 32 : 16);
     s.push((p->nbands - 1), 8);
     s.push(static_cast<uint8_t>(p->type), 8); // all values are reserved
     s.push(static_cast<uint8_t>(p->mode), 8);  // Encoding style, all values are reserved
@@ -225,15 +358,86 @@ void static write_quanta_header(encsp p, oBits& s) {
     s.push(p->quanta, qbytes * 8);
 }
 
+// Overview chunk, if there is one
+void static write_overview_header(const std::vector<uint8_t>& ovr, oBits& s) {
+    if (ovr.empty())
+        return;
+    push_sig("OV", s);
+    s.push(ovr.size(), 16); // Payload bytes
+    for (auto v : ovr)
+        s.push(v, 8);
+}
+
+// NoData mask chunks, the payload is split in chunks of up to 65535 bytes
+// Not needed in stored mode, the stored values include the nodata ones
+void static write_mask_header(encsp p, oBits& s) {
+    if (!p->mask_payload || p->mode == qb3_mode::QB3M_STORED)
+        return;
+    const auto& payload = *p->mask_payload;
+    for (size_t i = 0; i < payload.size(); i += 0xffff) {
+        const size_t len = std::min(payload.size() - i, size_t(0xffff));
+        push_sig("NM", s);
+        s.push(len, 16);
+        for (size_t j = 0; j < len; j++)
+            s.push(payload[i + j], 8);
+    }
+}
+
+// Checksum chunk, the values are filled in after encoding
+// CRC32C of the data, followed by the CRC32C of the raster if lossless
+static size_t crc_payload(encsp p) {
+    return p->quanta > 1 ? 4 : 8;
+}
+
+void static write_crc_header(encsp p, oBits& s) {
+    if (!p->crc)
+        return;
+    push_sig("CR", s);
+    s.push(crc_payload(p), 16);
+    for (size_t i = 0; i < crc_payload(p); i++)
+        s.push(0u, 8);
+}
+
+// Fill in the checksum chunk, which is just before the DT signature
+// The data checksum is a pass over the output, the stored bytes are only final after the streams are joined,
+// the overview chunk is inserted and the RLE or stored mode is chosen
+// Returns len
+static size_t write_crc(encsp p, uint8_t* d, size_t data_position, size_t len, uint32_t raster_crc) {
+    if (!p->crc || !len)
+        return len;
+    uint32_t crc[2] = { crc32c(0, d + data_position, len - data_position), raster_crc };
+    uint8_t* chunk = d + data_position - 2 - crc_payload(p);
+    for (size_t i = 0; i < crc_payload(p); i++)
+        chunk[i] = static_cast<uint8_t>(crc[i / 4] >> (8 * (i % 4)));
+    return len;
+}
+
+// Stream sizes, if there is more than one stream
+// The number of streams, followed by the sizes of all but the last stream, in bytes
+// The sizes are filled in after encoding, the chunk size only depends on the number of streams
+void static write_streams_header(encsp p, oBits& s) {
+    if (p->nstreams < 2 || p->mode == qb3_mode::QB3M_STORED)
+        return;
+    push_sig("MS", s);
+    s.push(1 + 8 * (p->nstreams - 1), 16);
+    s.push(p->nstreams, 8);
+    for (size_t k = 0; k + 1 < p->nstreams; k++)
+        s.push(p->ssize[k], 64);
+}
+
 // Data header has no known size
 void static write_data_header(encsp, oBits& s) {
     push_sig("DT", s);
 }
 
-void static write_headers(encsp p, oBits& s) {
+void static write_headers(encsp p, oBits& s, const std::vector<uint8_t>& ovr) {
     write_qb3_header(p, s);
     write_cband_header(p, s);
     write_quanta_header(p, s);
+    write_overview_header(ovr, s);
+    write_streams_header(p, s);
+    write_mask_header(p, s);
+    write_crc_header(p, s);
     write_data_header(p, s);
 }
 
@@ -372,97 +576,363 @@ static size_t raw_size(encsp const &p) {
 int qb3_get_encoder_state(encsp p) { return p->error; }
 
 // ONLY QB3M_BASE and QB3M_CF are supported here
-template<typename T> static int enc(const T *source, oBits &s, encsp p)
+// The fast encoder is specialized for the default layouts of 1 to 4 bands
+// The best encoder spends most of its time elsewhere, it only has the generic version
+template<typename T, typename Q, typename O>
+static int enc(QB3::source<T>& source, O* s, encsp p, const Q& quant, void* means, uint32_t* crc)
+{
+    auto m = reinterpret_cast<T*>(means);
+    if (p->mode != qb3_mode::QB3M_DEFAULT)
+        return QB3::encode_best(source, s, *p, quant, m, crc);
+    if (is_default_cband(p->nbands, p->cband.data()))
+        switch (p->nbands) {
+        case 1: return QB3::encode_fast<T, Q, O, 1>(source, s, *p, quant, m, crc);
+        case 2: return QB3::encode_fast<T, Q, O, 2>(source, s, *p, quant, m, crc);
+        case 3: return QB3::encode_fast<T, Q, O, 3>(source, s, *p, quant, m, crc);
+        case 4: return QB3::encode_fast<T, Q, O, 4>(source, s, *p, quant, m, crc);
+        }
+    return QB3::encode_fast(source, s, *p, quant, m, crc);
+}
+
+// Encoder input, a raster in memory or a line reader
+struct encoder_input {
+    const void* image;
+    qb3_get_lines fn;
+    void* ctx;
+};
+
+// Reads each strip with the line reader, into a strip buffer
+template<typename T>
+struct lines_source : QB3::source<T> {
+    lines_source(encsp p, const encoder_input& in) : fn(in.fn), ctx(in.ctx), buffer(B * p->xsize * p->nbands) {}
+    const T* strip(size_t y) { return fn(ctx, y, buffer.data()) ? buffer.data() : nullptr; }
+
+private:
+    const qb3_get_lines fn;
+    void* const ctx;
+    std::vector<T> buffer;
+};
+
+// Clears the mask bits of the pixels where all the bands have the nodata value
+template<typename T>
+static bool mask_nodata(encsp p, QB3::source<T>& in, BMap& mask) {
+    const T nodata = static_cast<T>(p->nodata);
+    const size_t xsize = p->xsize, nbands = p->nbands;
+    for (size_t y = 0; y < p->ysize; y += B) {
+        if (y + B > p->ysize)
+            y = p->ysize - B;
+        const T* v = in.strip(y);
+        if (!v)
+            return false;
+        for (size_t j = 0; j < B; j++)
+            for (size_t x = 0; x < xsize; x++, v += nbands) {
+                size_t c = 0;
+                while (c < nbands && v[c] == nodata)
+                    c++;
+                if (c == nbands)
+                    mask.clear(x, y + j);
+            }
+    }
+    return true;
+}
+
+template<typename T>
+static bool mask_nodata(encsp p, const encoder_input& in, BMap& mask) {
+    if (in.image) {
+        QB3::image_source<T> source(reinterpret_cast<const T*>(in.image), p->xsize * p->nbands);
+        return mask_nodata(p, source, mask);
+    }
+    lines_source<T> source(p, in);
+    return mask_nodata(p, source, mask);
+}
+
+// Packs the mask chunks payload, the nodata value followed by the packed mask
+static void mask_payload(encsp p, const BMap& mask, std::vector<uint8_t>& payload) {
+    const size_t vsize = typesizes[p->type];
+    payload.assign(vsize + (mask.max_packed() + 7) / 8, 0);
+    memcpy(payload.data(), &p->nodata, vsize);
+    oBits s(payload.data() + vsize);
+    mask.pack(s);
+    payload.resize(vsize + s.tobyte());
+}
+
+// Builds the valid pixel mask and the mask chunks payload
+// The payload stays empty if no pixels are masked. Returns false if the input can't be read
+static bool build_mask(encsp p, const encoder_input& in, BMap& mask, std::vector<uint8_t>& payload) {
+    mask = BMap(p->xsize, p->ysize);
+    bool success = false;
+    switch (typesizes[p->type]) {
+    case 1: success = mask_nodata<uint8_t>(p, in, mask); break;
+    case 2: success = mask_nodata<uint16_t>(p, in, mask); break;
+    case 4: success = mask_nodata<uint32_t>(p, in, mask); break;
+    case 8: success = mask_nodata<uint64_t>(p, in, mask); break;
+    }
+    payload.clear();
+    if (success && !mask.full())
+        mask_payload(p, mask, payload);
+    return success;
+}
+
+template<typename T, typename Q, typename O>
+static int enc(const encoder_input& in, O* s, encsp p, const Q& quant, void* means, uint32_t* crc = nullptr)
 {
-    int error(0);
-    if (p->quanta < 2) {
-        if (p->mode == qb3_mode::QB3M_DEFAULT)
-            error = QB3::encode_fast(source, s, *p);
-        else
-            error = QB3::encode_best(source, s, *p);
-        return error;
+    if (in.image) {
+        QB3::image_source<T> source(reinterpret_cast<const T*>(in.image), p->xsize * p->nbands);
+        return enc(source, s, p, quant, means, crc);
     }
+    lines_source<T> source(p, in);
+    return enc(source, s, p, quant, means, crc);
+}
 
-    // Quantized encoding
-    // Use a subencoder to encode one B lines strip at a time,
-    // while keeping the running state from one strip to the next
-    // This avoids doubling memory for the input data
-    encs subimg(*p);
-    subimg.ysize = B;
-    auto ysz(p->ysize);
-    // In bytes
-    auto linesize = p->xsize * p->nbands * typesizes[p->type];
-    // Temporary data buffer for a strip
-    std::vector<char> buffer(linesize * subimg.ysize);
-    auto src = reinterpret_cast<const char*>(source);
-
-#define QENC(T) quantize(reinterpret_cast<T *>(buffer.data()), s, subimg);\
-                if (subimg.mode == qb3_mode::QB3M_DEFAULT) \
-                    error = QB3::encode_fast(\
-                        reinterpret_cast<std::make_unsigned<T>::type *>(buffer.data()), s, subimg);\
-                else\
-                    error = QB3::encode_best(\
-                        reinterpret_cast<std::make_unsigned<T>::type *>(buffer.data()), s, subimg);
-
-    for (size_t y = 0; y < ysz; y += subimg.ysize) {
-        // Shift the last strip up to handle the edge
-        if (y + subimg.ysize > ysz)
-            src -= linesize * (y + subimg.ysize - ysz);
-        memcpy(buffer.data(), src, buffer.size());
-        switch (p->type) {
-        case qb3_dtype::QB3_U8:  QENC(uint8_t);  break;
-        case qb3_dtype::QB3_I8:  QENC(int8_t);   break;
-        case qb3_dtype::QB3_U16: QENC(uint16_t); break;
-        case qb3_dtype::QB3_I16: QENC(int16_t);  break;
-        case qb3_dtype::QB3_U32: QENC(uint32_t); break;
-        case qb3_dtype::QB3_I32: QENC(int32_t);  break;
-        case qb3_dtype::QB3_U64: QENC(uint64_t); break;
-        case qb3_dtype::QB3_I64: QENC(int64_t);  break;
-        default: return QB3E_EINV;
+// Quantized encoding, the values are quantized as they are read
+// S is the input type, signed or unsigned
+template<typename S, typename O> static int qenc(const encoder_input& in, O* s, encsp p, void* means)
+{
+    typedef typename std::make_unsigned<S>::type T;
+    if (p->away)
+        return enc<T>(in, s, p, quantizer<T, S, true>(*p), means);
+    return enc<T>(in, s, p, quantizer<T, S, false>(*p), means);
+}
+
+// Halve the overview size, in place, edge values are repeated
+// With a mask, only the valid values are used and an output value is masked if none are valid
+template<typename T>
+static void halve(T* v, size_t& xsize, size_t& ysize, size_t bands, T sbit, BMap* mask) {
+    const size_t ox = (xsize + 1) / 2, oy = (ysize + 1) / 2;
+    BMap omask(mask ? ox : 0, mask ? oy : 0);
+    for (size_t y = 0; y < oy; y++)
+        for (size_t x = 0; x < ox; x++) {
+            size_t sxy[4], n = 0;
+            for (size_t i = 0; i < 4; i++) {
+                auto sy = std::min(2 * y + i / 2, ysize - 1), sx = std::min(2 * x + i % 2, xsize - 1);
+                if (!mask || mask->bit(sx, sy))
+                    sxy[n++] = sy * xsize + sx;
+            }
+            if (!n) {
+                omask.clear(x, y);
+                continue;
+            }
+            for (size_t c = 0; c < bands; c++) {
+                QB3::mean_acc<T> acc(2, sbit);
+                for (size_t i = 0; i < n; i++)
+                    acc.add(v[sxy[i] * bands + c]);
+                v[(y * ox + x) * bands + c] = acc.get();
+            }
+        }
+    xsize = ox;
+    ysize = oy;
+    if (mask)
+        *mask = omask;
+}
+
+// Overview chunk payload, the log2 of the reduction factor followed by a QB3 stream
+// The values are already quantized, the stream has the same mode, band mapping and quanta as p
+// The masked values, if any, have the same nodata value as p
+// Returns the payload size, 0 if it fails
+template<typename T>
+static size_t encode_overview(encsp p, const T* v, size_t xsize, size_t ysize, const BMap* mask, std::vector<uint8_t>& out) {
+    encs sub(*p);
+    sub.xsize = xsize;
+    sub.ysize = ysize;
+    sub.overview = false;
+    sub.crc = false;
+    sub.nstreams = 1;
+    std::vector<uint8_t> payload;
+    sub.has_nodata = mask && !mask->full();
+    if (sub.has_nodata)
+        mask_payload(p, *mask, payload);
+    sub.mask = sub.has_nodata ? mask : nullptr;
+    sub.mask_payload = sub.has_nodata ? &payload : nullptr;
+    for (size_t c = 0; c < sub.nbands; c++)
+        sub.band[c].runbits = sub.band[c].prev = sub.band[c].cf = 0;
+    out.assign(1 + qb3_max_encoded_size(&sub), 0);
+    oBits s(out.data() + 1);
+    write_headers(&sub, s, std::vector<uint8_t>());
+    QB3::image_source<T> in(v, xsize * sub.nbands);
+    int error = (sub.mode == qb3_mode::QB3M_DEFAULT) ? 
+        QB3::encode_fast(in, &s, sub) : QB3::encode_best(in, &s, sub);
+    return error ? 0 : 1 + s.tobyte();
+}
+
+// Build the overview chunk payload from the block means
+// The means are reduced by 2 until the encoded stream fits in a chunk
+// With a nodata mask, the blocks with no valid pixels are masked in the overview
+template<typename T>
+static void make_overview(encsp p, T* means, std::vector<uint8_t>& ovr) {
+    size_t xsize = (p->xsize + B - 1) / B, ysize = (p->ysize + B - 1) / B;
+    BMap mask(p->mask ? xsize : 0, p->mask ? ysize : 0);
+    for (size_t y = 0; p->mask && y < ysize; y++)
+        for (size_t x = 0; x < xsize; x++) // Same blocks as the encoder, the last ones overlap
+            if (!p->mask->quad(std::min(x * B, p->xsize - B), std::min(y * B, p->ysize - B)))
+                mask.clear(x, y);
+    BMap* const pmask = p->mask ? &mask : nullptr;
+    for (uint8_t level = 2; xsize >= B && ysize >= B; level++) {
+        // Don't bother encoding if it is very unlikely to fit
+        if (xsize * ysize * p->nbands * sizeof(T) < 16 * 0xffff) {
+            auto len = encode_overview(p, means, xsize, ysize, pmask, ovr);
+            if (len && len <= 0xffff) {
+                ovr.resize(len);
+                ovr[0] = level;
+                return;
+            }
         }
-        src += linesize * subimg.ysize;
+        halve(means, xsize, ysize, p->nbands, QB3::sign_bit<T>(*p), pmask);
     }
+    ovr.clear(); // Too small for an overview
+}
 
+// Encode the raster data in p->nstreams outputs, returns the error code
+template<typename O>
+static int encode_data(encsp p, const encoder_input& in, O* s, void* means, uint32_t* crc) {
+#define ENC(T) enc<T>(in, s, p, QB3::noquant<T>(), means, crc)
+#define QENC(T) qenc<T>(in, s, p, means)
+#define FENC(T) enc<T>(in, s, p, floatmap<T>(), means, crc)
+    if (p->quanta > 1) {
+        switch (p->type) {
+        case qb3_dtype::QB3_U8:  return QENC(uint8_t);
+        case qb3_dtype::QB3_I8:  return QENC(int8_t);
+        case qb3_dtype::QB3_U16: return QENC(uint16_t);
+        case qb3_dtype::QB3_I16: return QENC(int16_t);
+        case qb3_dtype::QB3_U32: return QENC(uint32_t);
+        case qb3_dtype::QB3_I32: return QENC(int32_t);
+        case qb3_dtype::QB3_U64: return QENC(uint64_t);
+        case qb3_dtype::QB3_I64: return QENC(int64_t);
+        default: return QB3E_EINV; // Invalid type
+        }
+    }
+    switch (p->type) {
+    case qb3_dtype::QB3_U8:
+    case qb3_dtype::QB3_I8:
+        return ENC(uint8_t);
+    case qb3_dtype::QB3_U16:
+    case qb3_dtype::QB3_I16:
+        return ENC(uint16_t);
+    case qb3_dtype::QB3_U32:
+    case qb3_dtype::QB3_I32:
+        return ENC(uint32_t);
+    case qb3_dtype::QB3_U64:
+    case qb3_dtype::QB3_I64:
+        return ENC(uint64_t);
+    case qb3_dtype::QB3_F32:
+        return FENC(uint32_t);
+    case qb3_dtype::QB3_F64:
+        return FENC(uint64_t);
+    default:
+        return QB3E_EINV; // Invalid type
+    } // data type
+#undef FENC
 #undef QENC
-    return error;
+#undef ENC
 }
 
-// The encode public API, returns 0 if an error is detected
-size_t qb3_encode(encsp p, void* source, void* destination) {
+// Overview chunk payload from the block means, empty if it doesn't fit
+static void build_overview(encsp p, void* means, std::vector<uint8_t>& ovr) {
+    switch (typesizes[p->type]) {
+    case 1: make_overview(p, reinterpret_cast<uint8_t*>(means), ovr); break;
+    case 2: make_overview(p, reinterpret_cast<uint16_t*>(means), ovr); break;
+    case 4: make_overview(p, reinterpret_cast<uint32_t*>(means), ovr); break;
+    case 8: make_overview(p, reinterpret_cast<uint64_t*>(means), ovr); break;
+    }
+}
+
+// Is stored mode better than the encoded stream of size len
+static bool use_stored(encsp p, const std::vector<uint8_t>& ovr, size_t len) {
+    return raw_size(p) + (ovr.empty() ? 0 : 4 + ovr.size()) + (p->crc ? 4 + crc_payload(p) : 0) <= len;
+}
+
+// Output buffers for the streams after the first one, which follows the headers
+static void stream_buffers(encsp p, std::vector<std::vector<uint8_t>>& buffers, std::vector<oBits>& streams) {
+    const size_t columns = (p->xsize + B - 1) / B;
+    buffers.resize(p->nstreams - 1);
+    for (size_t k = 1; k < p->nstreams; k++) {
+        // Block columns in this stream
+        buffers[k - 1].resize(max_data_size(p, (columns + p->nstreams - 1 - k) / p->nstreams));
+        streams.push_back(oBits(buffers[k - 1].data()));
+    }
+}
+
+// Appends the other streams to the first one and rewrites the headers with the stream sizes
+// Returns the output position in bytes
+static size_t join_streams(encsp p, uint8_t* d, size_t data_position, std::vector<oBits>& streams,
+    const std::vector<std::vector<uint8_t>>& buffers)
+{
+    auto len = streams[0].tobyte();
+    if (streams.size() < 2)
+        return len;
+    p->ssize[0] = len - data_position;
+    for (size_t k = 1; k < streams.size(); k++) {
+        p->ssize[k] = streams[k].tobyte();
+        memcpy(d + len, buffers[k - 1].data(), p->ssize[k]);
+        len += p->ssize[k];
+    }
+    oBits sh(d);
+    write_headers(p, sh, std::vector<uint8_t>());
+    sh.tobyte();
+    return len;
+}
+
+// Copy the input values to d, for the stored mode, returns false on failure
+static bool copy_input(encsp p, const encoder_input& in, uint8_t* d) {
+    if (in.image) {
+        memcpy(d, in.image, raw_size(p));
+        return true;
+    }
+    const size_t linesize = p->xsize * p->nbands * typesizes[p->type];
+    for (size_t y = 0; y < p->ysize; y += B) {
+        if (y + B > p->ysize)
+            y = p->ysize - B;
+        if (!in.fn(in.ctx, y, d + y * linesize))
+            return false;
+    }
+    return true;
+}
+
+// Encode, returns 0 if an error is detected
+static size_t encode_input(encsp p, const encoder_input& in, void* destination) {
     auto const mode = p->mode; // save the user chosen mode
     // Turn off the RLE for now
     bool rle = (mode == qb3_mode::QB3M_RLE || mode == qb3_mode::QB3M_CF_RLE);
     if (rle)
         p->mode = (mode == qb3_mode::QB3M_RLE) ? QB3M_BASE : QB3M_CF;
 
+    // Each stream starts from a clean state, so the encoder can be reused
+    for (size_t c = 0; c < p->nbands; c++)
+        p->band[c].runbits = p->band[c].prev = p->band[c].cf = 0;
+
     uint8_t* const d = reinterpret_cast<uint8_t*>(destination);
     oBits s(d);
+    std::vector<uint8_t> ovr; // Overview chunk payload, added after the data is encoded
+    std::vector<uint8_t> bmeans; // Block means, when the overview is needed
+    if (p->overview)
+        bmeans.resize(((p->xsize + B - 1) / B) * ((p->ysize + B - 1) / B) * p->nbands * typesizes[p->type]);
+    void* means = bmeans.empty() ? nullptr : bmeans.data();
+    // Raster checksum, only when lossless
+    uint32_t raster_crc = 0;
+    uint32_t* rcrc = (p->crc && p->quanta < 2) ? &raster_crc : nullptr;
     // size of headers or zero if raw
     size_t data_position(0);
-    write_headers(p, s);
+    write_headers(p, s, ovr);
     data_position = (s.position() + 7) / 8; // It is byte aligned already
     if (p->error) return 0;
 
-#define ENC(T) enc(reinterpret_cast<const T*>(source), s, p)
-    switch (p->type) {
-    case qb3_dtype::QB3_U8:
-    case qb3_dtype::QB3_I8:
-        p->error = ENC(uint8_t); break;
-    case qb3_dtype::QB3_U16:
-    case qb3_dtype::QB3_I16:
-        p->error = ENC(uint16_t); break;
-    case qb3_dtype::QB3_U32:
-    case qb3_dtype::QB3_I32:
-        p->error = ENC(uint32_t); break;
-    case qb3_dtype::QB3_U64:
-    case qb3_dtype::QB3_I64:
-        p->error = ENC(uint64_t); break;
-    default:
-        p->error = QB3E_EINV; // Invalid type
-    } // data type
-#undef ENC
+    // The first stream continues after the headers
+    std::vector<oBits> streams(1, s);
+    std::vector<std::vector<uint8_t>> buffers;
+    stream_buffers(p, buffers, streams);
+    p->error = encode_data(p, in, streams.data(), means, rcrc);
+    auto len = join_streams(p, d, data_position, streams, buffers); // current output position in bytes
+    if (!p->error && means) {
+        build_overview(p, means, ovr);
+        if (!ovr.empty()) { // Move the data and rewrite the headers, including the overview
+            const size_t ovr_chunk = 4 + ovr.size();
+            memmove(d + data_position + ovr_chunk, d + data_position, len - data_position);
+            oBits sh(d);
+            write_headers(p, sh, ovr);
+            data_position = sh.tobyte();
+            len += ovr_chunk;
+        }
+    }
 
-    auto len = (s.position() + 7) / 8; // current output position in bytes
     if (rle) {
         p->mode = mode; // restore the user selected mode
         if (p->error) // Bail out if there was an error
@@ -486,31 +956,122 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
 
                 // new stream, same buffer
                 oBits srle(d);
-                write_headers(p, srle);
+                write_headers(p, srle, ovr);
                 if (p->error)
                     return 0;
                 // Copy the RLE0FFFF data at the current position, they are not overlapping
                 memcpy(d + srle.tobyte(), d + len, rle_size);
                 // Return the new size
-                return srle.tobyte() + rle_size;
+                return write_crc(p, d, srle.tobyte(), srle.tobyte() + rle_size, raster_crc);
             }
         }
     }
 
     // Maybe stored mode is better
-    if (!p->error && raw_size(p) <= len) {
+    if (!p->error && use_stored(p, ovr, len)) {
         // new stream, same buffer
         oBits sraw(d);
         p->mode = QB3M_STORED; // Force raw mode
-        write_headers(p, sraw);
+        write_headers(p, sraw, ovr);
         if (p->error)
             return 0;
         // Copy the raw data at the current position, they are not overlapping
-        memcpy(d + sraw.tobyte(), source, raw_size(p));
+        if (!copy_input(p, in, d + sraw.tobyte()))
+            p->error = QB3E_ERR;
         p->mode = mode; // restore the user selected mode, in case of reuse
+        if (p->error)
+            return 0;
         // Return the new size
-        return sraw.tobyte() + raw_size(p);
+        return write_crc(p, d, sraw.tobyte(), sraw.tobyte() + raw_size(p), raster_crc);
+    }
+    return (p->error) ? 0 : write_crc(p, d, data_position, len, raster_crc);
+}
+
+// Calls fn with the nodata mask set in p, when there are masked pixels
+// The mask is built from the input, before encoding
+template<typename F>
+static size_t with_mask(encsp p, const encoder_input& in, F fn) {
+    BMap mask;
+    std::vector<uint8_t> payload;
+    if (p->has_nodata && !build_mask(p, in, mask, payload)) {
+        p->error = QB3E_ERR;
+        return 0;
+    }
+    if (!payload.empty()) {
+        p->mask = &mask;
+        p->mask_payload = &payload;
+    }
+    auto len = fn();
+    p->mask = nullptr;
+    p->mask_payload = nullptr;
+    return len;
+}
+
+// The encode public API, returns 0 if an error is detected
+size_t qb3_encode(encsp p, const void* source, void* destination) {
+    encoder_input in = { source, nullptr, nullptr };
+    return with_mask(p, in, [&] { return encode_input(p, in, destination); });
+}
+
+size_t qb3_encode_lines(encsp p, qb3_get_lines fn, void* ctx, void* destination) {
+    if (!fn) {
+        p->error = QB3E_EINV;
+        return 0;
     }
-    return (p->error) ? 0 : s.tobyte();
+    encoder_input in = { nullptr, fn, ctx };
+    return with_mask(p, in, [&] { return encode_input(p, in, destination); });
+}
+
+// Size of the headers, including the overview chunk
+static size_t headers_size(encsp p, const std::vector<uint8_t>& ovr) {
+    std::vector<uint8_t> buffer(128 + p->nbands + ovr.size() + max_mask_size(p));
+    oBits s(buffer.data());
+    write_headers(p, s, ovr);
+    return s.tobyte();
 }
 
+// Exact encoded size, with the mask already set
+static size_t encoded_size(encsp p, const encoder_input& in) {
+    auto const mode = p->mode;
+    bool rle = (mode == qb3_mode::QB3M_RLE || mode == qb3_mode::QB3M_CF_RLE);
+    if (rle)
+        p->mode = (mode == qb3_mode::QB3M_RLE) ? QB3M_BASE : QB3M_CF;
+    for (size_t c = 0; c < p->nbands; c++)
+        p->band[c].runbits = p->band[c].prev = p->band[c].cf = 0;
+
+    std::vector<uint8_t> ovr;
+    std::vector<uint8_t> bmeans;
+    if (p->overview)
+        bmeans.resize(((p->xsize + B - 1) / B) * ((p->ysize + B - 1) / B) * p->nbands * typesizes[p->type]);
+    void* means = bmeans.empty() ? nullptr : bmeans.data();
+    // Only count the bits
+    std::vector<cBits> streams(p->nstreams);
+    p->error = encode_data(p, in, streams.data(), means, nullptr);
+    // The overview is built in the same mode as in qb3_encode
+    if (!p->error && means)
+        build_overview(p, means, ovr);
+    p->mode = mode;
+    if (p->error)
+        return 0;
+    auto len = headers_size(p, ovr);
+    for (auto& s : streams)
+        len += s.tobyte();
+
+    // RLE depends on the encoded bytes, so it needs a real encode
+    if (rle && len <= qb3_max_encoded_size(p) / 2) {
+        std::vector<uint8_t> buffer(qb3_max_encoded_size(p));
+        return encode_input(p, in, buffer.data());
+    }
+
+    if (use_stored(p, ovr, len)) {
+        p->mode = QB3M_STORED;
+        len = headers_size(p, ovr) + raw_size(p);
+        p->mode = mode;
+    }
+    return len;
+}
+
+size_t qb3_encoded_size(encsp p, const void* source) {
+    encoder_input in = { source, nullptr, nullptr };
+    return with_mask(p, in, [&] { return encoded_size(p, in); });
+}
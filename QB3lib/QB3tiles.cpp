@@ -0,0 +1,298 @@
+/*
+Content: C API QB3 tiled container
+
+Copyright 2023 Esri
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Contributors:  Lucian Plesea
+*/
+
+#include "QB3common.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Container header
+// 4 sig
+// 4 xsize
+// 4 ysize
+// 2 tile xsize - 1
+// 2 tile ysize - 1
+// 1 nbands - 1
+// 1 data type
+// 6 reserved, zero
+// Followed by the index, 8 bytes offset and 8 bytes size per tile, row major
+// Then by the tile data region
+constexpr size_t QB3T_HDRSZ = 4 + 4 + 4 + 2 + 2 + 1 + 1 + 6;
+constexpr size_t QB3T_IDXSZ = 16;
+
+// Tiled writer
+struct tws {
+    FILE* f;
+    size_t xsize, ysize, tilex, tiley, nbands;
+    size_t ntx, nty; // Tile grid
+    qb3_dtype type;
+    uint64_t end; // Current file size
+    std::vector<uint64_t> index; // Offset and size, by tile
+    std::vector<uint8_t> buffer; // For encoding
+    bool error;
+};
+
+// Tiled reader
+struct trs {
+    const uint8_t* data; // Mapped file
+    size_t size;
+    size_t xsize, ysize, tilex, tiley, nbands;
+    size_t ntx, nty;
+    qb3_dtype type;
+#if defined(_WIN32)
+    HANDLE file, mapping;
+#endif
+};
+
+// Little endian values of n bytes
+static void put_le(uint8_t* d, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        d[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+static uint64_t get_le(const uint8_t* s, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++)
+        v |= static_cast<uint64_t>(s[i]) << (8 * i);
+    return v;
+}
+
+twsp qb3_tiled_create(const char* fname, size_t xsize, size_t ysize,
+    size_t tilex, size_t tiley, size_t bands, qb3_dtype dt)
+{
+    if (!fname || xsize == 0 || xsize > 0xffffffffull || ysize == 0 || ysize > 0xffffffffull
+        || tilex < 4 || tilex > 0x10000ul || tiley < 4 || tiley > 0x10000ul
+        || bands == 0 || bands > QB3_MAXBANDS || dt > qb3_dtype::QB3_F64)
+        return nullptr;
+    auto f = fopen(fname, "wb");
+    if (!f)
+        return nullptr;
+    auto w = new tws;
+    w->f = f;
+    w->xsize = xsize;
+    w->ysize = ysize;
+    w->tilex = tilex;
+    w->tiley = tiley;
+    w->nbands = bands;
+    w->type = dt;
+    w->ntx = (xsize + tilex - 1) / tilex;
+    w->nty = (ysize + tiley - 1) / tiley;
+    w->index.assign(2 * w->ntx * w->nty, 0);
+    w->error = false;
+
+    // Header, followed by an empty index which is written when done
+    std::vector<uint8_t> hdr(QB3T_HDRSZ + QB3T_IDXSZ * w->ntx * w->nty, 0);
+    memcpy(hdr.data(), "QB3T", 4);
+    put_le(&hdr[4], xsize, 4);
+    put_le(&hdr[8], ysize, 4);
+    put_le(&hdr[12], tilex - 1, 2);
+    put_le(&hdr[14], tiley - 1, 2);
+    hdr[16] = static_cast<uint8_t>(bands - 1);
+    hdr[17] = static_cast<uint8_t>(dt);
+    w->end = hdr.size();
+    w->error = (hdr.size() != fwrite(hdr.data(), 1, hdr.size(), f));
+    return w;
+}
+
+bool qb3_tiled_write(twsp w, size_t tx, size_t ty, const void* data, size_t size) {
+    if (w->error || tx >= w->ntx || ty >= w->nty || !data || size == 0)
+        return false;
+    if (size != fwrite(data, 1, size, w->f)) {
+        w->error = true;
+        return false;
+    }
+    // A tile written again replaces the previous one, which is left unused in the file
+    auto idx = &w->index[2 * (ty * w->ntx + tx)];
+    idx[0] = w->end;
+    idx[1] = size;
+    w->end += size;
+    return true;
+}
+
+bool qb3_tiled_encode(twsp w, size_t tx, size_t ty, encsp p, const void* source) {
+    if (w->error || p->xsize != w->tilex || p->ysize != w->tiley
+        || p->nbands != w->nbands || p->type != w->type)
+        return false;
+    w->buffer.resize(qb3_max_encoded_size(p));
+    auto size = qb3_encode(p, source, w->buffer.data());
+    if (size == 0)
+        return false;
+    return qb3_tiled_write(w, tx, ty, w->buffer.data(), size);
+}
+
+bool qb3_tiled_finish(twsp w) {
+    bool ok = !w->error;
+    if (ok) {
+        std::vector<uint8_t> idx(w->index.size() * 8);
+        for (size_t i = 0; i < w->index.size(); i++)
+            put_le(&idx[i * 8], w->index[i], 8);
+        ok = (0 == fseek(w->f, static_cast<long>(QB3T_HDRSZ), SEEK_SET))
+            && (idx.size() == fwrite(idx.data(), 1, idx.size(), w->f));
+    }
+    ok &= (0 == fclose(w->f));
+    delete w;
+    return ok;
+}
+
+// Map the whole file read only, sets r->data and r->size
+static bool map_file(const char* fname, trsp r) {
+#if defined(_WIN32)
+    r->file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (r->file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER sz;
+    r->mapping = nullptr;
+    if (GetFileSizeEx(r->file, &sz) && sz.QuadPart > 0) {
+        r->size = static_cast<size_t>(sz.QuadPart);
+        r->mapping = CreateFileMappingA(r->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (r->mapping)
+        r->data = static_cast<const uint8_t*>(MapViewOfFile(r->mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!r->data) {
+        if (r->mapping)
+            CloseHandle(r->mapping);
+        CloseHandle(r->file);
+        return false;
+    }
+#else
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (0 == fstat(fd, &st) && st.st_size > 0) {
+        r->size = static_cast<size_t>(st.st_size);
+        void* m = mmap(nullptr, r->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED)
+            r->data = static_cast<const uint8_t*>(m);
+    }
+    close(fd); // The mapping stays valid
+    if (!r->data)
+        return false;
+#endif
+    return true;
+}
+
+static void unmap_file(trsp r) {
+#if defined(_WIN32)
+    UnmapViewOfFile(r->data);
+    CloseHandle(r->mapping);
+    CloseHandle(r->file);
+#else
+    munmap(const_cast<uint8_t*>(r->data), r->size);
+#endif
+}
+
+trsp qb3_tiled_open(const char* fname) {
+    if (!fname)
+        return nullptr;
+    auto r = new trs;
+    r->data = nullptr;
+    r->size = 0;
+    if (!map_file(fname, r)) {
+        delete r;
+        return nullptr;
+    }
+    const uint8_t* h = r->data;
+    if (r->size < QB3T_HDRSZ || 0 != memcmp(h, "QB3T", 4)) {
+        qb3_tiled_close(r);
+        return nullptr;
+    }
+    r->xsize = static_cast<size_t>(get_le(h + 4, 4));
+    r->ysize = static_cast<size_t>(get_le(h + 8, 4));
+    r->tilex = static_cast<size_t>(get_le(h + 12, 2)) + 1;
+    r->tiley = static_cast<size_t>(get_le(h + 14, 2)) + 1;
+    r->nbands = static_cast<size_t>(h[16]) + 1;
+    r->type = static_cast<qb3_dtype>(h[17]);
+    if (r->xsize == 0 || r->ysize == 0 || r->tilex < 4 || r->tiley < 4
+        || r->nbands > QB3_MAXBANDS || r->type > qb3_dtype::QB3_F64) {
+        qb3_tiled_close(r);
+        return nullptr;
+    }
+    r->ntx = (r->xsize + r->tilex - 1) / r->tilex;
+    r->nty = (r->ysize + r->tiley - 1) / r->tiley;
+    // The index has to be complete
+    if (r->size < QB3T_HDRSZ + QB3T_IDXSZ * r->ntx * r->nty) {
+        qb3_tiled_close(r);
+        return nullptr;
+    }
+    return r;
+}
+
+void qb3_tiled_close(trsp r) {
+    unmap_file(r);
+    delete r;
+}
+
+void qb3_tiled_info(const trsp r, size_t* info) {
+    info[0] = r->xsize;
+    info[1] = r->ysize;
+    info[2] = r->tilex;
+    info[3] = r->tiley;
+    info[4] = r->nbands;
+}
+
+qb3_dtype qb3_tiled_type(const trsp r) {
+    return r->type;
+}
+
+decsp qb3_tiled_tile(const trsp r, size_t tx, size_t ty) {
+    if (tx >= r->ntx || ty >= r->nty)
+        return nullptr;
+    const uint8_t* idx = r->data + QB3T_HDRSZ + QB3T_IDXSZ * (ty * r->ntx + tx);
+    const uint64_t offset = get_le(idx, 8), size = get_le(idx + 8, 8);
+    // Missing or out of bounds tile
+    if (size == 0 || offset > r->size || size > r->size - offset)
+        return nullptr;
+    const uint8_t* tile = r->data + offset;
+#if !defined(_WIN32)
+    // Read the whole tile ahead, from the start of the page
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t start = reinterpret_cast<uintptr_t>(tile) & ~(page - 1);
+    madvise(reinterpret_cast<void*>(start), reinterpret_cast<uintptr_t>(tile) + size - start, MADV_WILLNEED);
+#endif
+    // The decoder reads directly from the mapping, it doesn't modify the input
+    size_t image_size[3];
+    auto p = qb3_read_start(const_cast<uint8_t*>(tile), static_cast<size_t>(size), image_size);
+    if (!p)
+        return nullptr;
+    if (image_size[0] != r->tilex || image_size[1] != r->tiley || image_size[2] != r->nbands
+        || qb3_get_type(p) != r->type || !qb3_read_info(p)) {
+        qb3_destroy_decoder(p);
+        return nullptr;
+    }
+    return p;
+}
+
+size_t qb3_tiled_read(const trsp r, size_t tx, size_t ty, void* destination) {
+    auto p = qb3_tiled_tile(r, tx, ty);
+    if (!p)
+        return 0;
+    auto len = qb3_read_data(p, destination);
+    qb3_destroy_decoder(p);
+    return len;
+}
@@ -18,75 +18,124 @@ Contributors:  Lucian Plesea
 #pragma once
 #include <cinttypes>
 #include <cassert>
+#include <cstring>
 #include <type_traits>
 #include <limits>
 #include <utility>
 
 // Input bitstream, doesn't go past size
+// The bits at the read position are kept in a 64 bit buffer, which is refilled with a
+// single unaligned load when it drops below MINBITS valid bits
 class iBits {
 public:
-    iBits(const uint8_t* data, size_t size) : v(data), len(size * 8), bitp(0) {}
+    // peek() always has at least this many valid bits
+    static constexpr size_t MINBITS = 57;
+
+    iBits(const uint8_t* data, size_t size) : v(data), len(size * 8), bitp(0), acc(0), nbits(0) {
+        refill();
+    }
+
+    // Empty stream
+    iBits() : iBits(nullptr, 0) {}
 
     // informational
-    size_t avail() const { return len - bitp; }
+    size_t avail() const { return (bitp < len) ? (len - bitp) : 0; }
     bool empty() const { return avail() == 0; }
-    // read position in bits
+    // read position in bits, can be past the end if more bits were consumed than available
     size_t position() const { return bitp; }
+    // More bits were consumed than available, the missing bits were read as zero
+    bool overrun() const { return bitp > len; }
 
     // Single bit fetch
     uint64_t get() {
         if (empty()) return 0; // Don't go past the end
-        uint64_t val = static_cast<uint64_t>((v[bitp / 8] >> (bitp % 8)) & 1);
-        bitp++;
+        uint64_t val = acc & 1;
+        advance(1);
         return val;
     }
 
-    // Advance read position by d bits
+    // Advance read position by d bits, reading past the end returns zeros
     void advance(size_t d) {
-        bitp = (bitp + d < len) ? (bitp + d) : len;
+        bitp += d;
+        if (d + MINBITS <= nbits) { // Still enough bits in the buffer
+            acc >>= d;
+            nbits -= d;
+        }
+        else
+            refill();
     }
 
-    // Get 64bits without changing the state
+    // Get at least MINBITS bits without changing the state
     uint64_t peek() const {
+        return acc;
+    }
+
+    // Get 64bits without changing the state, slower
+    uint64_t peek64() const {
         if (avail() >= 64)
             return (v[bitp / 8] >> (bitp % 8)) |
             (*reinterpret_cast<const uint64_t*>(v + ((bitp + 7) / 8)) << ((8 - bitp) % 8));
-        if (empty())
-            return 0;
-        uint64_t val = v[bitp / 8] >> (bitp % 8);
-        // (bitp + bits) is byte aligned, we need data from 7 or 8 more bytes
-        for (size_t bits = 8 - (bitp % 8); bits < 64 && bitp + bits < len; bits += 8)
-            val |= static_cast<uint64_t>(v[(bitp + bits) / 8]) << bits;
-        return val;
+        return tail();
     }
 
     // Not very efficient for small number of bits
     uint64_t pull(size_t bits = 1) {
         assert(bits && bits <= 64 && !empty());
-        uint64_t val = peek() & (~0ull >> (64 - bits));
+        uint64_t val = (bits > MINBITS ? peek64() : peek()) & (~0ull >> (64 - bits));
         advance(bits);
         return val;
     }
 
 private:
+    // Load the buffer from the read position
+    void refill() {
+        if (bitp / 8 + 8 <= len / 8) { // Single load
+            uint64_t val;
+            memcpy(&val, v + bitp / 8, 8);
+            acc = val >> (bitp % 8);
+            nbits = 64 - bitp % 8;
+        }
+        else { // Close to the end
+            acc = tail();
+            nbits = 64;
+        }
+    }
+
+    // 64 bits at the read position, when they are not all available
+    uint64_t tail() const {
+        if (empty())
+            return 0;
+        uint64_t val = v[bitp / 8] >> (bitp % 8);
+        // (bitp + bits) is byte aligned, we need data from 7 or 8 more bytes
+        for (size_t bits = 8 - (bitp % 8); bits < 64 && bitp + bits < len; bits += 8)
+            val |= static_cast<uint64_t>(v[(bitp + bits) / 8]) << bits;
+        return val;
+    }
+
     const uint8_t* v;
     // In bits
-    const size_t len; // in bits, multiple of 8
+    size_t len; // in bits, multiple of 8
     size_t bitp; // read position
+    uint64_t acc; // Bits at the read position
+    size_t nbits; // Valid bits in acc, bits past the end count as valid
 };
 
 // Output bitstream, doesn't check the output buffer size
+// The bits are collected in a 64 bit accumulator, each full word is written with a single store
+// The last partial word is only written by tobyte(), which has to be called before using the output
+// Nothing is written past the byte holding the last bit, so no output buffer padding is needed
 class oBits {
 public:
-    oBits(uint8_t * data) : v(data), bitp(0) {}
+    oBits(uint8_t * data) : v(data), acc(0), bitp(0) {}
 
     // Rewind to a bit position before the current one
     size_t rewind(size_t pos = 0) {
         // Don't go past the current end
-        if (pos < position()) {
+        if (pos < bitp) {
+            if ((pos >> 6) != (bitp >> 6)) // Reload the word holding pos, it was written already
+                memcpy(&acc, v + (pos >> 6) * 8, 8);
+            acc &= ~(~0ull << (pos & 63)); // clear the bits past pos
             bitp = pos;
-            if (bitp & 7) // clear partial bits in the last byte
-                v[bitp / 8] &= 0xff >> (8 - (bitp & 7));
         }
         return position();
     }
@@ -97,29 +146,26 @@ public:
         static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value,
             "Only works with unsigned integral types");
         assert(nbits < 65);
-        size_t used = 0;
-        if (bitp % 8 != 0) { // Partial byte at the end
-            v[bitp / 8] |= static_cast<uint8_t>(val << (bitp % 8));
-            used = 8ull - (bitp % 8);
+        const size_t used = bitp & 63;
+        acc |= static_cast<uint64_t>(val) << used;
+        if (used + nbits >= 64) { // Word is full
+            memcpy(v + (bitp >> 6) * 8, &acc, 8);
+            // Bits that didn't fit, shift in two steps to get zero when used is 0
+            acc = (static_cast<uint64_t>(val) >> 1) >> (63 - used);
         }
-        for (; nbits > used; used += 8)
-            v[(bitp + used) / 8] = static_cast<uint8_t>(val >> used);
         bitp += nbits;
     }
 
-    // Append content from other output bitstream
+    // Append content from other output bitstream, which doesn't need to be flushed
     oBits& operator+=(const oBits&other) {
-        auto len = other.bitp;
-        for(auto pv = reinterpret_cast<uint64_t *>(other.v); len >= 64; len -= 64, pv++)
-            push(*pv, 64);
-        // bits at the end
-        if (len) {
-            uint64_t acc = 0;
-            auto pv = other.v + (other.bitp / 64) * 8;
-            for (size_t i = 0; i * 8 < len; i++)
-                acc |= static_cast<uint64_t>(pv[i]) << (i * 8);
-            push(acc, len);
+        for (size_t i = 0; i < other.bitp / 64; i++) {
+            uint64_t val;
+            memcpy(&val, other.v + i * 8, 8);
+            push(val, 64);
         }
+        // bits at the end
+        if (other.bitp & 63)
+            push(other.acc, other.bitp & 63);
         return *this;
     }
 
@@ -133,13 +179,59 @@ public:
         return bitp;
     }
 
-    // Round position to byte boundary
+    // Round position to byte boundary and write the partial word
     size_t tobyte() {
+        memcpy(v + (bitp >> 6) * 8, &acc, ((bitp & 63) + 7) / 8);
         bitp = (bitp + 7) & ~0x7;
+        if (0 == (bitp & 63)) // Completed the word
+            acc = 0;
         return bitp >> 3; // In bytes
     }
 
 private:
     uint8_t *v;
+    uint64_t acc; // Bits of the current word, the ones above position are zero
     size_t bitp; // write position
 };
+
+// Counts the bits instead of writing them, same interface as oBits
+class cBits {
+public:
+    cBits() : bitp(0) {}
+
+    size_t rewind(size_t pos = 0) {
+        if (pos < bitp)
+            bitp = pos;
+        return bitp;
+    }
+
+    template<typename T>
+    void push(T, size_t nbits) {
+        static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value,
+            "Only works with unsigned integral types");
+        assert(nbits < 65);
+        bitp += nbits;
+    }
+
+    cBits& operator+=(const oBits& other) {
+        bitp += other.position();
+        return *this;
+    }
+
+    template<typename T>
+    void push(std::pair<size_t, T> p) {
+        bitp += p.first;
+    }
+
+    size_t position() const {
+        return bitp;
+    }
+
+    size_t tobyte() {
+        bitp = (bitp + 7) & ~0x7;
+        return bitp >> 3;
+    }
+
+private:
+    size_t bitp;
+};
@@ -1,5 +1,7 @@
 /*
-Copyright 2020-2021 Esri
+Content: Bitmap packing, used for the NoData mask
+
+Copyright 2020-2023 Esri
 Licensed under the Apache License, Version 2.0 (the "License");
 you may not use this file except in compliance with the License.
 You may obtain a copy of the License at
@@ -14,83 +16,15 @@ Contributors:  Lucian Plesea
 */
 
 #include "bmap.h"
-#include <iostream>
-#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include "bitstream.h"
 
-BMap::BMap(int x, int y) : _x(x), _y(y), _lw((x + 7) / 8) {
-    v.assign(_lw * ((y + 7) / 8), ~0); // All data
-}
-
-// runlength
-int rlen(const uint8_t* ch, size_t mlen) {
-    static const size_t MRUN = 0x300 + 0xffff;
-    mlen = std::min(mlen, MRUN);
-    const uint8_t* v = ch;
-    while (mlen-- && *ch == *v) v++;
-    return static_cast<int>(v - ch);
-}
-
-#define CODE 0xC5
-void RLE(std::vector<uint8_t>& v, std::vector<uint8_t>& result) {
-    // Do a byte RLE on v
-    std::vector<uint8_t> tmp;
-    
-    size_t len = 0;
-    while (len < v.size()) {
-        int l = rlen(v.data() + len, v.size() - len);
-        uint8_t c = v[len];
-        if (l < 4) {
-            tmp.push_back(c);
-            if (CODE == c)
-                tmp.push_back(0);
-            len += 1;
-            continue;
-        }
-        // encoded sequence
-        tmp.push_back(CODE);
-        if (l >= 0x100) {
-            if (l >= 0x300) {
-                tmp.push_back(3);
-                l -= 0x300;
-                len -= 0x300;
-            }
-            tmp.push_back(l >> 8);
-        }
-        tmp.push_back(l);
-        tmp.push_back(c);
-        len += l;
-    }
-    result.swap(tmp);
-}
-
-void unRLE(std::vector<uint8_t>& v, std::vector<uint8_t>& result) {
-    std::vector<uint8_t> tmp;
-    for (int i = 0; i < v.size(); i++) {
-        uint8_t c = v[i];
-        if (CODE != c) {
-            tmp.push_back(c);
-            continue;
-        }
-        // sequence, use at() so it checks for out of bounds
-        c = v.at(++i);
-        if (0 == c) {
-            tmp.push_back(CODE);
-            continue;
-        }
-        size_t len = c;
-        if (len < 4) {
-            if (len == 3)
-                len += v.at(++i);
-            len = (len << 8) + v.at(++i);
-        }
-        c = v.at(++i);
-        tmp.insert(tmp.end(), len, c);
-    }
-    result.swap(tmp);
+BMap::BMap(size_t x, size_t y) : _x(x), _y(y), _lw((x + 7) / 8) {
+    v.assign(_lw * ((y + 7) / 8), ~0ull); // All data
 }
 
+// Returns the number of units read, check the stream for overrun
 size_t BMap::unpack(iBits& s) {
     for (auto& it : v) {
         uint8_t code;
@@ -125,7 +59,7 @@ size_t BMap::unpack(iBits& s) {
                     case 0b011:  q = q << 8;            break; // 0b1000
                     case 0b100:  q = q | 0xff80;        break; // 0b1101
                     case 0b101:  q = (q << 8) | 0x80ff; break; // 0b0111
-                    case 0b1100: q = (q | 0x80);        break; // 0b0001 
+                    case 0b1100: q = (q | 0x80);        break; // 0b0001
                     case 0b1101: q = (q | 0x80) << 8;   break; // 0b0100
                     case 0b1110: q = q | 0xff00;        break; // 0b1110
                     default: q = (q << 8) | 0xff; // 0b1011, code is 0b1111
@@ -138,10 +72,10 @@ size_t BMap::unpack(iBits& s) {
     return v.size();
 }
 
-// 3-4 prefix bits tertiary packing
-size_t BMap::pack(oBits& s) {
+// 3-4 prefix bits tertiary packing, returns the stream position in bits
+size_t BMap::pack(oBits& s) const {
     for (auto it : v) {
-        if (0 == it or ~(0ULL) == it) {
+        if (0 == it || ~(0ULL) == it) {
             s.push(it & 0b11u, 2);
             continue;
         }
@@ -151,7 +85,7 @@ size_t BMap::pack(oBits& s) {
         size_t halves = 0;
         for (size_t i = 0; i < 64; i += 8) {
             b = (it >> i) & 0xff;
-            if (0 == b or 0xff == b)
+            if (0 == b || 0xff == b)
                 halves++;
         }
 
@@ -164,7 +98,7 @@ size_t BMap::pack(oBits& s) {
         s.push(0b10u, 2); // switch to secondary, encoded by quart
         for (size_t j = 0; j < 4; j++, it >>= 16) {
             auto q = static_cast<uint16_t>(it);
-            if (0 == q or 0xffff == q) {
+            if (0 == q || 0xffff == q) {
                 s.push(q & 0b11u, 2);
                 continue;
             }
@@ -172,16 +106,16 @@ size_t BMap::pack(oBits& s) {
             // Test the two bytes, build the prefix code
             // If there is only one mixed byte, lower 7 bits get captured in val
             uint8_t code;
-            uint64_t val;
+            uint64_t val = 0;
             b = static_cast<uint8_t>(q >> 8); // High byte first
-            if (0 == b or 0xff == b)
+            if (0 == b || 0xff == b)
                 code = b & 0b1100;
             else {
                 val = b & 0x7f;
                 code = (val == b) ? 0b1000: 0b0100;
             }
             b = static_cast<uint8_t>(q);
-            if (0 == b or 0xff == b)
+            if (0 == b || 0xff == b)
                 code |= b & 0b11;
             else {
                 val = b & 0x7f;
@@ -189,10 +123,10 @@ size_t BMap::pack(oBits& s) {
             }
 
             // Translate the prefix to tertiary codeword
-            // Codes 6 to 15 are rotated to allow detection 
+            // Codes 6 to 15 are rotated to allow detection
             // of code length from the lower 3 bits
             // b10 switch to tertiary encoding is added
-            static uint8_t xlate[16] = {
+            static const uint8_t xlate[16] = {
                 0xff,  // 0000 Not used
                 0b011000 | 0b10,  // 0001 rotated from 0b1100
                  0b01000 | 0b10,  // 0010
@@ -225,5 +159,5 @@ size_t BMap::pack(oBits& s) {
             s.push((val << b) | code, 7ull + b);
         }
     }
-    return s.size_bits();
+    return s.position();
 }
@@ -0,0 +1,86 @@
+/*
+Content: Bitmap with 8x8 bit units, used for the NoData mask
+
+Copyright 2020-2023 Esri
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Contributors:  Lucian Plesea
+*/
+
+#pragma once
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+class iBits;
+class oBits;
+
+// Each 8x8 unit is a 64bit value, the bits are in bit interleaved (Morton) order, see bitmap.md
+// A 4x4 quad of a unit is 16 consecutive bits, in the same order as the QB3 group values
+// A set bit is a valid pixel, a new bitmap has all the bits set
+class BMap {
+public:
+    BMap(size_t x = 0, size_t y = 0);
+    bool bit(size_t x, size_t y) const {
+        return 0 != (v[unit(x, y)] & bitmask(x, y));
+    }
+    void set(size_t x, size_t y) {
+        v[unit(x, y)] |= bitmask(x, y);
+    }
+    void clear(size_t x, size_t y) {
+        v[unit(x, y)] &= ~(bitmask(x, y));
+    }
+    // 16 bits of the 4x4 group at x, y, bit i is the group value i
+    uint64_t quad(size_t x, size_t y) const {
+        if (0 == ((x | y) & 3)) // Aligned, a quarter of a unit
+            return (v[unit(x, y)] >> (16 * (((x >> 2) & 1) | ((y >> 1) & 2)))) & 0xffff;
+        uint64_t q = 0;
+        for (size_t i = 0; i < 16; i++)
+            q |= uint64_t(bit(x + ((i & 1) | ((i >> 1) & 2)), y + (((i >> 1) & 1) | ((i >> 2) & 2)))) << i;
+        return q;
+    }
+    // All the bits are set
+    bool full() const {
+        for (auto u : v)
+            if (~u)
+                return false;
+        return true;
+    }
+    size_t dsize() const { return v.size() * sizeof(uint64_t); }
+    void getsize(size_t& x, size_t& y) const { x = _x; y = _y; }
+    // Upper bound of the packed size, in bits
+    size_t max_packed() const { return v.size() * 66; }
+    size_t pack(oBits& stream) const;
+    size_t unpack(iBits& stream);
+    bool compare(const BMap& other) const {
+        return v == other.v;
+    }
+private:
+    size_t unit(size_t x, size_t y) const {
+        return _lw * (y / 8) + x / 8;
+    }
+    static uint64_t bitmask(size_t x, size_t y) {
+        static const uint8_t _xy[64] = {
+            0,  1,  4,  5, 16, 17, 20, 21,
+            2,  3,  6,  7, 18, 19, 22, 23,
+            8,  9, 12, 13, 24, 25, 28, 29,
+           10, 11, 14, 15, 26, 27, 30, 31,
+           32, 33, 36, 37, 48, 49, 52, 53,
+           34, 35, 38, 39, 50, 51, 54, 55,
+           40, 41, 44, 45, 56, 57, 60, 61,
+           42, 43, 46, 47, 58, 59, 62, 63
+        };
+        return 1ull << _xy[((y & 7) * 8) + (x & 7)];
+    }
+    size_t _x, _y;
+    size_t _lw; // Line width
+    std::vector<uint64_t> v;
+};
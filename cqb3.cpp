@@ -20,10 +20,33 @@ Contributors:  Lucian Plesea
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <chrono>
 #include <string>
 #include <vector>
 #include <utility>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
+#endif
 
 // From https://github.com/lucianpls/libicd
 #include <icd_codecs.h>
@@ -41,10 +64,22 @@ struct options {
         verbose(false), 
         decode(false),
         time(0),
-        quanta(0)
-    {};
+        quanta(0),
+        threads(0),
+        raw(false),
+        big_endian(false),
+        crc(false),
+        streams(1),
+        has_nodata(false),
+        nodata(0),
+        raw_type(QB3_U8)
+    {
+        raw_size[0] = raw_size[1] = raw_size[2] = 0;
+    };
 
     uint64_t quanta;
+    size_t threads; // Batch mode worker threads, 0 is the number of cores
+    size_t raw_size[3]; // Raw input width, height and bands
     string in_fname;
     string out_fname;
     string error;
@@ -55,14 +90,27 @@ struct options {
     bool rle; // Skip RLE
     bool verbose;
     bool decode;
+    bool raw; // Raw binary input or output, instead of an image format
+    bool big_endian; // Raw values are big endian
+    bool crc; // Write checksums when encoding, check them when decoding
+    size_t streams; // Interleaved data streams, when encoding
+    bool has_nodata; // Mask the pixels with the nodata value, when encoding
+    double nodata;
+    qb3_dtype raw_type;
 };
 
 int Usage(const options &opt) {
     cerr << opt.error << endl << endl
         << "cqb3 [options] <input_filename> <output_filename>\n"
+        << "\tUse - as the file name for stdin or stdout\n"
         << "Options:\n"
         << "\t-v : verbose\n"
         << "\t-d : decode from QB3\n"
+        << "\t-c : add checksums when encoding, verify them when decoding\n"
+        << "\n"
+        << "Batch mode, when the input is a folder, a quoted wildcard pattern or @<listfile>\n"
+        << "\tThe output, if provided, is the output folder\n"
+        << "\t-j <n> : number of worker threads per stage\n"
         << "\n"
         << "Compression only options:\n"
         << "\t-b : best compression\n"
@@ -72,11 +120,263 @@ int Usage(const options &opt) {
         << "\t-t : trim input to multiple of 4x4 pixels\n"
         << "\t-m <b,b,b> : core band mapping\n"
         << "\t-m x : exhaustive band mapping search\n"
+        << "\t-m c : band chain, each band is predicted from the previous one\n"
+        << "\t-s <n> : split the data in n interleaved streams, up to 4\n"
+        << "\t-n <v> : nodata value, pixels with v in all bands are masked\n"
+        << "\t-R <x,y,b,t> : raw input, x by y pixels with b bands\n"
+        << "\t     t is the value type, one of u8,i8,u16,i16,u32,i32,u64,i64,f32,f64\n"
+        << "\n"
+        << "Decompression only options:\n"
+        << "\t-R : raw output\n"
+        << "\n"
+        << "\t-E : raw values are big endian\n"
         ;
     return 1;
 }
 
 
+// Memory mapped file, falls back to a memory buffer if the file can't be mapped
+// Inputs are mapped copy-on-write, so they can be passed as writable buffers
+// Outputs are created with the maximum size and truncated to the final size when closed
+// The "-" file name is stdin for input and stdout for output, always buffered
+class mapped_file {
+public:
+    mapped_file() : data(nullptr), size(0), output(false), mapped(false), stdio(false) {
+#if defined(_WIN32)
+        file = INVALID_HANDLE_VALUE;
+#else
+        fd = -1;
+#endif
+    }
+    ~mapped_file() { close(); }
+
+    bool open(const string& fname) {
+        if (fname == "-")
+            return read_stdin();
+#if defined(_WIN32)
+        file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER sz;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &sz))
+            return false;
+        size = static_cast<size_t>(sz.QuadPart);
+        if (size) {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+            if (mapping) {
+                data = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+                CloseHandle(mapping); // The view keeps it open
+            }
+        }
+        mapped = (data != nullptr);
+        bool ok = mapped || read_all();
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        return ok;
+#else
+        fd = ::open(fname.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st))
+            return false;
+        size = static_cast<size_t>(st.st_size);
+        if (size) {
+            void* m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) {
+                data = static_cast<uint8_t*>(m);
+                madvise(m, size, MADV_SEQUENTIAL);
+            }
+        }
+        mapped = (data != nullptr);
+        bool ok = mapped || read_all();
+        ::close(fd);
+        fd = -1;
+        return ok;
+#endif
+    }
+
+    bool create(const string& fname, size_t max_size) {
+        output = true;
+        size = max_size;
+        if (fname == "-") {
+            stdio = true;
+            buffer.resize(size);
+            data = buffer.data();
+            return true;
+        }
+#if defined(_WIN32)
+        file = CreateFileA(fname.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+            CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        // Sets the file size
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), nullptr);
+        if (mapping) {
+            data = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+            CloseHandle(mapping);
+        }
+#else
+        fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return false;
+        if (0 == ftruncate(fd, static_cast<off_t>(size))) {
+            void* m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (m != MAP_FAILED) {
+                data = static_cast<uint8_t*>(m);
+                madvise(m, size, MADV_SEQUENTIAL);
+            }
+        }
+#endif
+        mapped = (data != nullptr);
+        if (!mapped) {
+            buffer.resize(size);
+            data = buffer.data();
+        }
+        return true;
+    }
+
+    // For outputs, final_size is the size of the file, returns false if writing fails
+    bool close(size_t final_size = 0) {
+        bool ok = true;
+        if (output && stdio) {
+#if defined(_WIN32)
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            ok = (final_size == fwrite(data, 1, final_size, stdout)) && (0 == fflush(stdout));
+        }
+#if defined(_WIN32)
+        if (mapped)
+            UnmapViewOfFile(data);
+        if (output && file != INVALID_HANDLE_VALUE) {
+            if (!mapped)
+                ok = write_all(final_size);
+            LARGE_INTEGER pos;
+            pos.QuadPart = static_cast<LONGLONG>(final_size);
+            ok &= SetFilePointerEx(file, pos, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (mapped)
+            munmap(data, size);
+        if (output && fd >= 0) {
+            if (!mapped)
+                ok = write_all(final_size);
+            ok &= (0 == ftruncate(fd, static_cast<off_t>(final_size)));
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        data = nullptr;
+        size = 0;
+        mapped = output = stdio = false;
+        buffer.clear();
+        return ok;
+    }
+
+    uint8_t* data;
+    size_t size;
+
+private:
+    bool read_stdin() {
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        buffer.resize(1024 * 1024);
+        size = 0;
+        while (auto got = fread(buffer.data() + size, 1, buffer.size() - size, stdin)) {
+            size += got;
+            if (size == buffer.size())
+                buffer.resize(buffer.size() * 2);
+        }
+        data = buffer.data();
+        return !ferror(stdin) && size != 0;
+    }
+
+    // Fallback, when mapping is not available
+    bool read_all() {
+        buffer.resize(size);
+        data = buffer.data();
+        for (size_t done = 0, chunk = 0; done < size; done += chunk) {
+            chunk = std::min(size - done, size_t(1) << 30);
+#if defined(_WIN32)
+            DWORD got = 0;
+            if (!ReadFile(file, data + done, static_cast<DWORD>(chunk), &got, nullptr) || got == 0)
+                return false;
+#else
+            auto got = ::read(fd, data + done, chunk);
+            if (got <= 0)
+                return false;
+#endif
+            chunk = static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    bool write_all(size_t len) {
+        for (size_t done = 0, chunk = 0; done < len; done += chunk) {
+            chunk = std::min(len - done, size_t(1) << 30);
+#if defined(_WIN32)
+            DWORD put = 0;
+            if (!WriteFile(file, data + done, static_cast<DWORD>(chunk), &put, nullptr) || put == 0)
+                return false;
+#else
+            auto put = ::write(fd, data + done, chunk);
+            if (put <= 0)
+                return false;
+#endif
+            chunk = static_cast<size_t>(put);
+        }
+        return true;
+    }
+
+    bool output, mapped, stdio;
+    vector<uint8_t> buffer;
+#if defined(_WIN32)
+    HANDLE file;
+#else
+    int fd;
+#endif
+};
+
+// Raw type names, in qb3_dtype order
+static const char* type_names[] = { "u8", "i8", "u16", "i16", "u32", "i32", "u64", "i64", "f32", "f64" };
+
+size_t type_size(qb3_dtype dt) {
+    if (dt >= QB3_F32)
+        return size_t(4) << (dt - QB3_F32);
+    return size_t(1) << (dt / 2);
+}
+
+// Raw input description, <x>,<y>,<bands>,<type>
+bool parse_raw(const string& s, options& opt) {
+    const char* c = s.c_str();
+    char* end(nullptr);
+    for (int i = 0; i < 3; i++) {
+        opt.raw_size[i] = strtoull(c, &end, 10);
+        if (end == c || *end != ',')
+            return false;
+        c = end + 1;
+    }
+    string name(c);
+    for (auto& ch : name)
+        ch = tolower(ch);
+    for (int i = 0; i < int(sizeof(type_names) / sizeof(*type_names)); i++) {
+        if (name == type_names[i]) {
+            opt.raw_type = static_cast<qb3_dtype>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Byte swaps values of tsize bytes, in place
+void swap_bytes(uint8_t* data, size_t size, size_t tsize) {
+    if (tsize < 2)
+        return;
+    for (size_t i = 0; i + tsize <= size; i += tsize)
+        std::reverse(data + i, data + i + tsize);
+}
+
 // A bandlist contains only digits and commas
 bool isbandmap(const string& s) {
     const string valid("01234567890,");
@@ -86,6 +386,33 @@ bool isbandmap(const string& s) {
     return true;
 }
 
+// Output file name from the input file name, without the path
+string derived_name(const string& in_fname, const char* ext) {
+    string fname(in_fname);
+    // Strip input path
+    if (fname.find_last_of("\\/") != string::npos)
+        fname = fname.substr(fname.find_last_of("\\/") + 1);
+    // Strip input extension
+    fname = fname.substr(0, fname.find_first_of("."));
+    return fname + ext;
+}
+
+bool is_folder(const string& fname) {
+#if defined(_WIN32)
+    auto attr = GetFileAttributesA(fname.c_str());
+    return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat st;
+    return 0 == stat(fname.c_str(), &st) && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Batch input is a folder, a wildcard pattern or a file list, @<listfile>
+bool is_batch(const string& in_fname) {
+    return !in_fname.empty() && (in_fname[0] == '@'
+        || in_fname.find_first_of("*?") != string::npos || is_folder(in_fname));
+}
+
 bool parse_args(int argc, char** argv, options& opt) {
     // Look at the executable name, it could be decode
     string codename(argv[0]);
@@ -118,25 +445,49 @@ bool parse_args(int argc, char** argv, options& opt) {
             case 'm':
                 // The next parameter is a comma separated band list if it starts with a digit
                 opt.mapping = "-"; // Disable mapping
-                if (i < argc && (string(argv[i + 1]) == "x" || isbandmap(argv[i + 1])))
+                if (i < argc && (string(argv[i + 1]) == "x" || string(argv[i + 1]) == "c" || isbandmap(argv[i + 1])))
                         opt.mapping = argv[++i];
                 break;
             case 'r':
                 opt.rle = true;
                 break;
+            case 'j':
+                if (i + 1 < argc && isdigit(argv[i + 1][0]))
+                    opt.threads = strtoull(argv[++i], nullptr, 10);
+                break;
+            case 'R':
+                opt.raw = true;
+                // Followed by the raw input description when encoding
+                if (i + 1 < argc && isdigit(argv[i + 1][0]) && !parse_raw(argv[++i], opt)) {
+                    opt.error = "Invalid raw input description";
+                    return false;
+                }
+                break;
+            case 'E':
+                opt.big_endian = true;
+                break;
+            case 'c':
+                opt.crc = true;
+                break;
+            case 's':
+                if (i + 1 < argc && isdigit(argv[i + 1][0]))
+                    opt.streams = strtoull(argv[++i], nullptr, 10);
+                break;
+            case 'n':
+                if (i + 1 >= argc) {
+                    opt.error = "Missing nodata value";
+                    return false;
+                }
+                opt.has_nodata = true;
+                opt.nodata = strtod(argv[++i], nullptr);
+                break;
             default:
                 opt.error = "Uknown option provided";
                 return false;
             }
         }
-        else { // positional args
-            // Could be just a slash
+        else { // positional args, - is stdin or stdout
             string val(argv[i]);
-            if (val.size() == 1) {
-                opt.error = "Pipe operation not yet supported";
-                return false;
-            }
-
             // file name
             if (opt.in_fname.empty())
                 opt.in_fname = val;
@@ -155,33 +506,42 @@ bool parse_args(int argc, char** argv, options& opt) {
         return false;
     }
 
-    // If output file name is not provided, extract from input file name
-    if (opt.out_fname.empty()) {
-        string fname(opt.in_fname);
-        // Strip input path, write output in current folder
-        if (fname.find_last_of("\\/") != string::npos)
-            fname = fname.substr(fname.find_last_of("\\/") + 1);
-        // Strip input extension
-        fname = fname.substr(0, fname.find_first_of("."));
-        opt.out_fname = fname + (opt.decode ? ".png" : ".qb3");
+    const char* ext = opt.decode ? (opt.raw ? ".raw" : ".png") : ".qb3";
+    if (is_batch(opt.in_fname)) {
+        if (opt.decode) {
+            opt.error = "Batch mode is only implemented for encoding";
+            return false;
+        }
+        // The output is a folder
+        if (!opt.out_fname.empty() && opt.out_fname.find_last_of("\\/") + 1 != opt.out_fname.size())
+            opt.out_fname += "/";
     }
+    else {
+        // If output file name is not provided, extract from input file name, in current folder
+        // When reading from stdin, write to stdout
+        if (opt.out_fname.empty())
+            opt.out_fname = (opt.in_fname == "-") ? "-" : derived_name(opt.in_fname, ext);
 
-    // If the output name is a folder, append a derived fname
-    if (opt.out_fname.find_last_of("\\/") == opt.out_fname.size()) {
-        string fname(opt.in_fname);
-        // Strip input path
-        if (fname.find_last_of("\\/") != string::npos)
-            fname = fname.substr(fname.find_last_of("\\/") + 1);
-        // Strip extension
-        fname = fname.substr(0, fname.find_first_of("."));
-        opt.out_fname += fname + (opt.decode ? ".png" : ".qb3");
+        // If the output name is a folder, append a derived fname
+        if (opt.out_fname.find_last_of("\\/") + 1 == opt.out_fname.size())
+            opt.out_fname += derived_name(opt.in_fname, ext);
     }
 
     // Conversion direction dependent options
     if (opt.decode) {
-        if (opt.trim || opt.best) {
-            opt.error = "Invalid option for QB3 decoding\n";
-            return Usage(opt);
+        if (opt.trim || opt.best || opt.raw_size[0]) {
+            opt.error = "Invalid option for QB3 decoding";
+            return false;
+        }
+    }
+    else if (opt.raw) {
+        if (opt.raw_size[0] == 0) {
+            opt.error = "Raw input needs the size and type";
+            return false;
+        }
+        if (opt.trim) {
+            opt.error = "Trim is not supported for raw input";
+            return false;
         }
     }
     return true;
@@ -201,21 +561,15 @@ const char *mode_string(qb3_mode m) {
 
 int decode_main(options& opts) {
     string fname = opts.in_fname;
-    FILE* f = fopen(fname.c_str(), "rb");
-    if (!f) {
+    mapped_file src;
+    if (!src.open(fname)) {
         cerr << "Can't open input file\n";
         exit(errno);
     }
-    fseek(f, 0, SEEK_END);
-    auto fsize = ftell(f);
-    rewind(f);
-    std::vector<uint8_t> src(fsize);
-    fread(src.data(), fsize, 1, f);
-    fclose(f);
 
-    // Decode the qb3
+    // Decode the qb3, directly from the input mapping
     size_t image_size[3];
-    auto qdec = qb3_read_start(src.data(), fsize, image_size);
+    auto qdec = qb3_read_start(src.data, src.size, image_size);
     vector<uint8_t> raw;
     double time_span(0);
 
@@ -228,13 +582,17 @@ int decode_main(options& opts) {
             opts.error = "Can't read qb3 file headers";
             throw 2;
         }
+        qb3_set_decoder_verify(qdec, opts.crc);
         if (opts.verbose) {
             auto bands = image_size[2];
-            cout << "Input:\nSize " << src.size() << " Image "
+            cout << "Input:\nSize " << src.size << " Image "
                 << image_size[0] << "x" << image_size[1] << "@" << bands << endl;
             cout << "QB3 mode :" << mode_string(qb3_get_mode(qdec)) << endl;
             if (qb3_get_quanta(qdec) > 1)
                 cout << " Quanta " << qb3_get_quanta(qdec) << endl;
+            double nodata;
+            if (qb3_get_nodata(qdec, &nodata))
+                cout << "NoData " << nodata << endl;
             size_t bandmap[QB3_MAXBANDS] = {};
             if (bands > 1 && qb3_get_coreband(qdec, bandmap)) { // Why would it fail?
                 ostringstream bmap;
@@ -244,6 +602,32 @@ int decode_main(options& opts) {
                 cout << "Band mapping " << bmap.str() << endl;
             }
         }
+        if (opts.raw) {
+            // Decode directly to the output file
+            qb3_set_decoder_swap(qdec, opts.big_endian);
+            auto rsize = qb3_decoded_size(qdec);
+            mapped_file out;
+            if (!out.create(opts.out_fname, rsize)) {
+                cerr << "Can't open output file\n";
+                exit(errno);
+            }
+            auto t1 = high_resolution_clock::now();
+            auto rbytes = qb3_read_data(qdec, out.data);
+            time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+            if (!out.close(rbytes) || rbytes != rsize) {
+                opts.error = "Error reading qb3 file data";
+                throw 2;
+            }
+            if (opts.verbose)
+                cerr << "Output raw " << type_names[qb3_get_type(qdec)] << "\nDecode time: "
+                << time_span << "s, rate: " << rsize / time_span / 1024 / 1024 << " MB/s\n";
+            qb3_destroy_decoder(qdec);
+            return 0;
+        }
+        // Bug in libicd, it expects input 16 bit data to be in big endian
+        // The decoder swaps the bytes as it writes the output
+        if (qb3_get_type(qdec) == QB3_U16)
+            qb3_set_decoder_swap(qdec, true);
         raw.resize(qb3_decoded_size(qdec));
         auto t1 = high_resolution_clock::now();
         auto rbytes = qb3_read_data(qdec, raw.data());
@@ -273,13 +657,6 @@ int decode_main(options& opts) {
         return 1;
     }
 
-    if (dt == QB3_U16) {
-        // Bug in libicd, it expects input 16 bit data to be in big endian
-        uint16_t * p = (uint16_t*)raw.data();
-        for (size_t i = 0; i < raw.size() / 2; ++i)
-            p[i] = (p[i] << 8) | (p[i] >> 8);
-    }
-
     // Convert to PNG using libicd
     Raster image;
     image.dt = ICD::ICDT_Byte;
@@ -296,31 +673,33 @@ int decode_main(options& opts) {
     //params.compression_level = 9;
 
     storage_manager png_src(raw.data(), raw.size());
-    vector<uint8_t> png_buffer(raw.size() + raw.size() / 10); // Pad by 10%
-    storage_manager png_blob(png_buffer.data(), png_buffer.size());
+    // The PNG is written directly to the output file, padded by 10%
+    mapped_file out;
+    if (!out.create(opts.out_fname, raw.size() + raw.size() / 10 + 1024)) {
+        cerr << "Can't open output file\n";
+        exit(errno);
+    }
+    storage_manager png_blob(out.data, out.size);
     auto t1 = high_resolution_clock::now();
     auto err_message = png_encode(params, png_src, png_blob);
     time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
     if (opts.error.size()) {
         cerr << "PNG encoding failed: " << err_message << endl;
+        out.close();
         return 2;
     }
     if (opts.verbose) {
         cerr << "Output PNG:\nSize " << png_blob.size 
-            << " Ratio: " << 100.0 * png_blob.size / src.size() << "%\n"
+            << " Ratio: " << 100.0 * png_blob.size / src.size << "%\n"
             << "Encode time: " << time_span << " rate: "
             << raw.size() / time_span / 1024 / 1024 << " MB/s\n";
     }
 
-    // Write the output file
-    f = fopen(opts.out_fname.c_str(), "wb");
-    if (!f) {
-        cerr << "Can't open output file\n";
-        exit(errno);
+    // Trim the output file
+    if (!out.close(png_blob.size)) {
+        cerr << "Error writing output file\n";
+        return 2;
     }
-    fwrite(png_blob.buffer, png_blob.size, 1, f);
-    fclose(f);
-
     return 0;
 }
 
@@ -353,95 +732,98 @@ void trim(Raster& raster, vector<unsigned char> &buffer) {
     swap(buffer, outbuffer);
 }
 
-// Handles the QB encoding
-int encode(Raster &raster, std::vector<std::uint8_t> &image, std::vector<std::uint8_t> &dest, options &opts) {
-    qb3_dtype dt = raster.dt == ICDT_Byte ? QB3_U8 : ICDT_UInt16 ? QB3_U16 : QB3_I16;
-    auto bands = raster.size.c;
-    auto qenc = qb3_create_encoder(raster.size.x, raster.size.y, bands, dt);
-    dest.resize(qb3_max_encoded_size(qenc));
-    size_t outsize(0);
-
-    if (!opts.mapping.empty()) {
-        size_t bmap[QB3_MAXBANDS];
-        if (opts.mapping == "-") {
-            for (int i = 0; i < bands; i++)
-                bmap[i] = i;
-        }
-        else {
-            string mapping(opts.mapping);
-            for (int i = 0; i < bands; i++) {
-                if (mapping.empty()) {
-                    bmap[i] = i; // identity
-                    continue;
-                }
-                char* end(nullptr);
-                bmap[i] = strtoul(mapping.c_str(), &end, 10);
-                while (',' == *end) end++; // Skip commas
-                mapping = end; // The unparsed part
+qb3_dtype qb3_type(const Raster& raster) {
+    return raster.dt == ICDT_Byte ? QB3_U8 : raster.dt == ICDT_UInt16 ? QB3_U16 : QB3_I16;
+}
+
+// Sets the band mapping, "-" is the identity, "c" the band chain, otherwise a list of core bands
+void set_mapping(encsp qenc, size_t bands, const string& opt_mapping) {
+    size_t bmap[QB3_MAXBANDS];
+    if (opt_mapping == "-") {
+        for (int i = 0; i < bands; i++)
+            bmap[i] = i;
+    }
+    else if (opt_mapping == "c") { // Chain, each band from the previous one
+        for (size_t i = 0; i < bands; i++)
+            bmap[i] = i ? i - 1 : 0;
+    }
+    else {
+        string mapping(opt_mapping);
+        for (int i = 0; i < bands; i++) {
+            if (mapping.empty()) {
+                bmap[i] = i; // identity
+                continue;
             }
+            char* end(nullptr);
+            bmap[i] = strtoul(mapping.c_str(), &end, 10);
+            while (',' == *end) end++; // Skip commas
+            mapping = end; // The unparsed part
         }
-        auto success = qb3_set_encoder_coreband(qenc, bands, bmap);
-        if (!success)
-            cerr << "Invalid band mapping, adjusted\n";
     }
+    auto success = qb3_set_encoder_coreband(qenc, bands, bmap);
+    if (!success)
+        cerr << "Invalid band mapping, adjusted\n";
+}
 
-    try {
-        high_resolution_clock::time_point t1, t2;
-        // Pick a mode
-        qb3_mode mode = opts.best ? qb3_mode::QB3M_BEST : qb3_mode::QB3M_BASE;
-        // If the RLE is set, pick more careful
-        if (opts.rle) {
-            if (QB3M_BEST == mode) {
-                mode = QB3M_CF; // Disable RLE for best
-            }
-            else if (QB3M_BASE == mode) {
-                mode = QB3M_RLE;
-            }
+// Creates the encoder with all the options, the output size has to be taken from it
+// The exhaustive band mapping search, -m x, is done by encode_image
+// Returns nullptr if an option is not valid
+encsp create_encoder(const Raster& raster, qb3_dtype dt, const options& opts) {
+    auto bands = raster.size.c;
+    auto qenc = qb3_create_encoder(raster.size.x, raster.size.y, bands, dt);
+    if (!opts.mapping.empty() && opts.mapping != "x")
+        set_mapping(qenc, bands, opts.mapping);
+
+    // Pick a mode
+    qb3_mode mode = opts.best ? qb3_mode::QB3M_BEST : qb3_mode::QB3M_BASE;
+    // If the RLE is set, pick more careful
+    if (opts.rle) {
+        if (QB3M_BEST == mode) {
+            mode = QB3M_CF; // Disable RLE for best
         }
-        qb3_set_encoder_mode(qenc, mode);
-        if (opts.quanta > 1) {
-            if (!qb3_set_encoder_quanta(qenc, opts.quanta, true)) {
-                cerr << "Invalid quanta\n";
-                throw 1;
-            }
-            else if (opts.verbose) {
-                cout << "Lossy compression, quantized by " << opts.quanta << endl;
-            }
+        else if (QB3M_BASE == mode) {
+            mode = QB3M_RLE;
         }
-        t1 = high_resolution_clock::now();
-        outsize = qb3_encode(qenc, static_cast<void*>(image.data()), dest.data());
-        t2 = high_resolution_clock::now();
-        opts.time += duration_cast<duration<double>>(t2 - t1).count();
-        if (outsize > dest.size()) { // Too late to catch, buffer did overflow
-            cerr << "QB3 output exceeds calculated maximum\n";
-            throw 2;
-        }
-        dest.resize(outsize);
     }
-    catch (int err_code) {
-        cerr << opts.error << endl;
+    qb3_set_encoder_mode(qenc, mode);
+    qb3_set_encoder_crc(qenc, opts.crc);
+    qb3_set_encoder_streams(qenc, opts.streams);
+    if (opts.has_nodata && !qb3_set_encoder_nodata(qenc, true, opts.nodata)) {
+        cerr << "Invalid nodata value\n";
         qb3_destroy_encoder(qenc);
-        return err_code;
+        return nullptr;
     }
-    qb3_destroy_encoder(qenc);
-    return 0; // success, encoded result in dest vector
+    if (opts.quanta > 1) {
+        if (!qb3_set_encoder_quanta(qenc, opts.quanta, true)) {
+            cerr << "Invalid quanta\n";
+            qb3_destroy_encoder(qenc);
+            return nullptr;
+        }
+        else if (opts.verbose) {
+            cout << "Lossy compression, quantized by " << opts.quanta << endl;
+        }
+    }
+    return qenc;
 }
 
-int encode_main(options& opts) {
-    string fname = opts.in_fname;
-    FILE* f = fopen(fname.c_str(), "rb");
-    if (!f) {
-        cerr << "Can't open input file\n";
-        return errno;
+// Handles the QB encoding, into dest which has to be at least qb3_max_encoded_size(qenc)
+// On success, dest.size is set to the encoded size
+int encode(encsp qenc, const void *image, storage_manager &dest, options &opts) {
+    auto t1 = high_resolution_clock::now();
+    auto outsize = qb3_encode(qenc, image, dest.buffer);
+    auto t2 = high_resolution_clock::now();
+    opts.time += duration_cast<duration<double>>(t2 - t1).count();
+    if (outsize > dest.size) { // Too late to catch, buffer did overflow
+        cerr << "QB3 output exceeds calculated maximum\n";
+        return 2;
     }
-    fseek(f, 0, SEEK_END);
-    auto fsize = ftell(f);
-    rewind(f);
-    std::vector<uint8_t> src(fsize);
-    storage_manager source = { src.data(), src.size() };
-    fread(source.buffer, fsize, 1, f);
-    fclose(f);
-    Raster raster;
+    dest.size = outsize;
+    return 0; // success, encoded result in dest vector
+}
+
+// Reads and decodes the input image from source, trims it if requested
+int load_image(storage_manager& source, Raster& raster, vector<uint8_t>& image, options& opts) {
+    auto fsize = source.size;
     auto error_message = image_peek(source, raster);
     if (error_message) {
         cerr << error_message << endl;
@@ -454,7 +836,7 @@ int encode_main(options& opts) {
         << ((raster.dt != ICDT_Byte) ? " 16bit\n" : "\n");
 
     if (raster.size.x < 4 || raster.size.y < 4) {
-        cerr << "QB3 requires input size between 4 and 65536 pixels\n";
+        cerr << "QB3 requires input size between 4 and 2^32 pixels\n";
         return 2;
     }
 
@@ -464,7 +846,7 @@ int encode_main(options& opts) {
     }
 
     codec_params params(raster);
-    std::vector<uint8_t> image(params.get_buffer_size());
+    image.resize(params.get_buffer_size());
     auto t = high_resolution_clock::now();
     auto message = stride_decode(params, source, image.data());
     auto time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t).count();
@@ -476,7 +858,7 @@ int encode_main(options& opts) {
 
     // Warnings
     if (strlen(params.error_message))
-        cerr << fname << " " << params.error_message << endl;
+        cerr << opts.in_fname << " " << params.error_message << endl;
 
     if (opts.verbose)
         cerr << "Decode time: " << time_span << "s\nRatio " << fsize * 100.0 / image.size() << "%, rate: "
@@ -487,68 +869,419 @@ int encode_main(options& opts) {
         if (opts.verbose)
             cerr << "Trimmed to " << raster.size.x << "x" << raster.size.y << endl;
     }
+    return 0;
+}
+
+// Raw input, the size and type are from the command line
+// The input is converted to little endian in place
+int load_raw(storage_manager& source, Raster& raster, options& opts) {
+    raster.size.x = opts.raw_size[0];
+    raster.size.y = opts.raw_size[1];
+    raster.size.c = opts.raw_size[2];
+    raster.size.z = 1;
+    raster.size.l = 0;
+    auto tsize = type_size(opts.raw_type);
+    auto rsize = raster.size.x * raster.size.y * raster.size.c * tsize;
+    if (opts.verbose)
+        cout << "Input raw " << raster.size.x << "x" << raster.size.y << "@"
+        << raster.size.c << " " << type_names[opts.raw_type] << "\nSize " << source.size << endl;
+
+    if (raster.size.x < 4 || raster.size.y < 4 || raster.size.c < 1 || raster.size.c > QB3_MAXBANDS) {
+        cerr << "QB3 requires input size between 4 and 2^32 pixels, up to " << QB3_MAXBANDS << " bands\n";
+        return 2;
+    }
+
+    if (source.size != rsize) {
+        cerr << "Raw input size should be " << rsize << " bytes\n";
+        return 2;
+    }
+
+    if (opts.big_endian)
+        swap_bytes(static_cast<uint8_t*>(source.buffer), source.size, tsize);
+    return 0;
+}
 
-    vector<uint8_t> dest;
+// Encodes the image to QB3 with the encoder from create_encoder, including the exhaustive band mapping search
+// dest has to be at least qb3_max_encoded_size(qenc), on success dest.size is set to the encoded size
+int encode_image(encsp qenc, const Raster& raster, const void* image, storage_manager& dest, options& opts) {
     auto bands = raster.size.c;
-    if (opts.mapping != "x" || bands < 3) { // Ignore the bands for 1 and 2 band images
-        opts.time = 0;
-        if (opts.mapping == "x")
-            opts.mapping = ""; // Back to default
-        auto status = encode(raster, image, dest, opts);
+    opts.time = 0; // To start accumulating
+    if (opts.mapping != "x" || bands < 3) // Ignore the bands for 1 and 2 band images
+        return encode(qenc, image, dest, opts);
+
+    // Try all mappings for RGB bands. Takes 9-ish times longer than the default
+    // TODO: Run them in parallel, which would take a lot more RAM?
+    if (bands > 4 || bands < 3) {
+        cerr << "Exhaustive band mix implemented only for RGB/RGBA inputs\n";
+        return 1; // Use error
+    }
+    string RGB_combo[] = { // Keep the alpha separate if it exists
+        "1,1,1", "0,0,0", "0,0,2", "0,1,0", "0,1,1",
+        "0,1,2", "1,1,2", "2,1,2", "2,2,2"
+    };
+    auto capacity = dest.size;
+    dest.size = 0;
+    vector<uint8_t> buffer(capacity);
+    int status = 0;
+    for (auto& combo : RGB_combo) {
+        storage_manager temp(buffer.data(), buffer.size());
+        set_mapping(qenc, bands, combo);
+        status = encode(qenc, image, temp, opts);
         if (status)
-            return status;
-    }
-    else { // Try all mappings for RGB bands. Takes 9-ish times longer than the default
-        // TODO: Run them in parallel, which would take a lot more RAM?
-        if (bands > 4 || bands < 3) {
-            cerr << "Exhaustive band mix implemented only for RGB/RGBA inputs\n";
-            return 1; // Use error
-        }
-        string RGB_combo[] = { // Keep the alpha separate if it exists
-            "1,1,1", "0,0,0", "0,0,2", "0,1,0", "0,1,1",
-            "0,1,2", "1,1,2", "2,1,2", "2,2,2"
-        };
-        opts.time = 0; // To start accumulating
-        for (auto& combo : RGB_combo) {
-            vector<uint8_t> temp;
-            opts.mapping = combo;
-            auto status = encode(raster, image, temp, opts);
-            if (status)
-                return status;
-            if (dest.size() == 0 || dest.size() > temp.size()) {
-                // Found a smaller encoding
-                if (opts.verbose)
-                    cout << "Band mix " << combo << ", size " << temp.size() << endl;
-                dest.resize(temp.size());
-                memcpy(dest.data(), temp.data(), dest.size());
-            }
+            break;
+        if (dest.size == 0 || dest.size > temp.size) {
+            // Found a smaller encoding
+            if (opts.verbose)
+                cout << "Band mix " << combo << ", size " << temp.size << endl;
+            dest.size = temp.size;
+            memcpy(dest.buffer, temp.buffer, dest.size);
         }
     }
+    return status;
+}
+
+int encode_main(options& opts) {
+    mapped_file src;
+    if (!src.open(opts.in_fname)) {
+        cerr << "Can't open input file\n";
+        return errno;
+    }
+    auto fsize = src.size;
+    storage_manager source = { src.data, src.size };
+    Raster raster;
+    std::vector<uint8_t> image;
+    qb3_dtype dt = opts.raw_type;
+    const void* pixels = src.data; // Raw input is encoded in place
+    auto status = opts.raw ? load_raw(source, raster, opts) : load_image(source, raster, image, opts);
+    if (status)
+        return status;
+    if (!opts.raw) {
+        dt = qb3_type(raster);
+        pixels = image.data();
+    }
+    auto rsize = raster.size.x * raster.size.y * raster.size.c * type_size(dt);
 
-    auto outsize = dest.size();
-    time_span = opts.time;
+    auto qenc = create_encoder(raster, dt, opts);
+    if (!qenc)
+        return 1;
+    // The output file is created with the maximum size, then trimmed
+    mapped_file out;
+    if (!out.create(opts.out_fname, qb3_max_encoded_size(qenc))) {
+        cerr << "Can't open output file\n";
+        exit(errno);
+    }
+    storage_manager dest(out.data, out.size);
+    status = encode_image(qenc, raster, pixels, dest, opts);
+    qb3_destroy_encoder(qenc);
+    if (status) {
+        out.close();
+        return status;
+    }
+
+    auto outsize = dest.size;
+    auto time_span = opts.time;
 
     if (opts.verbose) {
         cout << "Output\nSize: " << outsize << "\nEncode time : " << time_span << "s\n"
-            "Ratio " << outsize * 100.0 / image.size() << "%, "
-            "rate : " << image.size() / time_span / 1024 / 1024 << " MB/s\n";
+            "Ratio " << outsize * 100.0 / rsize << "%, "
+            "rate : " << rsize / time_span / 1024 / 1024 << " MB/s\n";
         cout << outsize * 100.0 / fsize << "% of the input\n";
     }
 
-    f = fopen(opts.out_fname.c_str(), "wb");
-    if (!f) {
-        cerr << "Can't open output file\n";
-        exit(errno);
+    // Trim the output file
+    if (!out.close(outsize)) {
+        cerr << "Error writing output file\n";
+        return 2;
     }
-    fwrite(dest.data(), outsize, 1, f);
-    fclose(f);
     return 0;
 }
 
+// Fixed capacity queue, connects the batch pipeline stages
+template<typename T> class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    // Waits while the queue is full, returns false if the queue is closed
+    bool push(T&& value) {
+        unique_lock<mutex> lock(m);
+        not_full.wait(lock, [this] { return q.size() < capacity || closed; });
+        if (closed)
+            return false;
+        q.push_back(move(value));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Waits while the queue is empty, returns false when the queue is closed and empty
+    bool pop(T& value) {
+        unique_lock<mutex> lock(m);
+        not_empty.wait(lock, [this] { return !q.empty() || closed; });
+        if (q.empty())
+            return false;
+        value = move(q.front());
+        q.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // No more values will be pushed
+    void close() {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> q;
+    mutex m;
+    condition_variable not_empty, not_full;
+};
+
+// One file going through the batch pipeline
+struct batch_job {
+    string in_fname;
+    string out_fname;
+    vector<uint8_t> src; // Input file content
+    Raster raster;
+    vector<uint8_t> image; // Decoded input
+    vector<uint8_t> dest; // QB3 output
+};
+
+typedef unique_ptr<batch_job> job_ptr;
+
+struct batch_stats {
+    batch_stats() : files(0), failed(0), in_size(0), raw_size(0), out_size(0) {}
+    atomic<size_t> files, failed, in_size, raw_size, out_size;
+};
+
+void batch_error(const string& fname, const char* message) {
+    static mutex m;
+    lock_guard<mutex> lock(m);
+    cerr << fname << ": " << message << endl;
+}
+
+bool read_file(const string& fname, vector<uint8_t>& buffer) {
+    FILE* f = fopen(fname.c_str(), "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    auto fsize = ftell(f);
+    rewind(f);
+    bool ok = fsize > 0;
+    if (ok) {
+        buffer.resize(fsize);
+        ok = (1 == fread(buffer.data(), fsize, 1, f));
+    }
+    fclose(f);
+    return ok;
+}
+
+bool write_file(const string& fname, const vector<uint8_t>& buffer) {
+    FILE* f = fopen(fname.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = (1 == fwrite(buffer.data(), buffer.size(), 1, f));
+    return (0 == fclose(f)) && ok;
+}
+
+#if defined(_WIN32)
+// Regular files matching the pattern, prefix is the pattern folder
+void find_files(const string& pattern, const string& prefix, vector<string>& names) {
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA(pattern.c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            names.push_back(prefix + fd.cFileName);
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+}
+#endif
+
+// Expands the batch input to a list of file names
+bool batch_inputs(const string& spec, vector<string>& names) {
+    if (spec[0] == '@') { // List file, one name per line
+        ifstream list(spec.substr(1));
+        if (!list)
+            return false;
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                names.push_back(line);
+        }
+        return true;
+    }
+
+    if (is_folder(spec)) {
+        string folder(spec);
+        if (folder.find_last_of("\\/") + 1 != folder.size())
+            folder += "/";
+#if defined(_WIN32)
+        find_files(folder + "*", folder, names);
+#else
+        DIR* dir = opendir(folder.c_str());
+        if (!dir)
+            return false;
+        while (auto entry = readdir(dir)) {
+            string fname(folder + entry->d_name);
+            if (entry->d_name[0] != '.' && !is_folder(fname))
+                names.push_back(fname);
+        }
+        closedir(dir);
+#endif
+    }
+    else { // Wildcard pattern
+#if defined(_WIN32)
+        auto pos = spec.find_last_of("\\/");
+        find_files(spec, pos == string::npos ? string() : spec.substr(0, pos + 1), names);
+#else
+        glob_t g;
+        if (0 == glob(spec.c_str(), 0, nullptr, &g))
+            for (size_t i = 0; i < g.gl_pathc; i++)
+                if (!is_folder(g.gl_pathv[i]))
+                    names.push_back(g.gl_pathv[i]);
+        globfree(&g);
+#endif
+    }
+    sort(names.begin(), names.end());
+    return true;
+}
+
+// Converts many files, with the read, decode, encode and write stages running concurrently
+int batch_main(options& opts) {
+    vector<string> names;
+    if (!batch_inputs(opts.in_fname, names)) {
+        cerr << "Can't read batch input " << opts.in_fname << endl;
+        return 1;
+    }
+    if (names.empty()) {
+        cerr << "No input files\n";
+        return 1;
+    }
+
+    size_t nthreads = opts.threads ? opts.threads : thread::hardware_concurrency();
+    nthreads = max(size_t(1), min(nthreads, names.size()));
+    // The queue capacity limits the number of images in memory
+    bounded_queue<job_ptr> to_decode(2 * nthreads), to_encode(2 * nthreads), to_write(2 * nthreads);
+    batch_stats stats;
+    auto t = high_resolution_clock::now();
+
+    thread reader([&] {
+        for (auto& fname : names) {
+            job_ptr job(new batch_job);
+            job->in_fname = fname;
+            job->out_fname = opts.out_fname + derived_name(fname, ".qb3");
+            if (!read_file(fname, job->src)) {
+                batch_error(fname, "Can't read input file");
+                stats.failed++;
+                continue;
+            }
+            stats.in_size += job->src.size();
+            to_decode.push(move(job));
+        }
+    });
+
+    vector<thread> decoders, encoders;
+    for (size_t i = 0; i < nthreads; i++) {
+        decoders.emplace_back([&] {
+            options o(opts);
+            o.verbose = false;
+            job_ptr job;
+            while (to_decode.pop(job)) {
+                o.in_fname = job->in_fname;
+                storage_manager source(job->src.data(), job->src.size());
+                if (o.raw ? load_raw(source, job->raster, o) : load_image(source, job->raster, job->image, o)) {
+                    batch_error(job->in_fname, "Decoding failed");
+                    stats.failed++;
+                    continue;
+                }
+                if (o.raw)
+                    swap(job->src, job->image);
+                vector<uint8_t>().swap(job->src); // Not needed anymore
+                stats.raw_size += job->image.size();
+                to_encode.push(move(job));
+            }
+        });
+
+        encoders.emplace_back([&] {
+            options o(opts);
+            o.verbose = false;
+            job_ptr job;
+            while (to_encode.pop(job)) {
+                auto dt = o.raw ? o.raw_type : qb3_type(job->raster);
+                auto qenc = create_encoder(job->raster, dt, o);
+                if (!qenc) {
+                    batch_error(job->in_fname, "Encoding failed");
+                    stats.failed++;
+                    continue;
+                }
+                job->dest.resize(qb3_max_encoded_size(qenc));
+                storage_manager dest(job->dest.data(), job->dest.size());
+                auto status = encode_image(qenc, job->raster, job->image.data(), dest, o);
+                qb3_destroy_encoder(qenc);
+                if (status) {
+                    batch_error(job->in_fname, "Encoding failed");
+                    stats.failed++;
+                    continue;
+                }
+                job->dest.resize(dest.size);
+                vector<uint8_t>().swap(job->image);
+                to_write.push(move(job));
+            }
+        });
+    }
+
+    thread writer([&] {
+        job_ptr job;
+        while (to_write.pop(job)) {
+            if (!write_file(job->out_fname, job->dest)) {
+                batch_error(job->out_fname, "Can't write output file");
+                stats.failed++;
+                continue;
+            }
+            stats.out_size += job->dest.size();
+            stats.files++;
+        }
+    });
+
+    // Each queue is closed after all its producers are done
+    reader.join();
+    to_decode.close();
+    for (auto& th : decoders)
+        th.join();
+    to_encode.close();
+    for (auto& th : encoders)
+        th.join();
+    to_write.close();
+    writer.join();
+    auto time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t).count();
+
+    cout << "Converted " << stats.files << " of " << names.size() << " files in "
+        << time_span << "s, " << nthreads << " threads per stage\n"
+        << "Input " << stats.in_size << " bytes, raw " << stats.raw_size
+        << " bytes, output " << stats.out_size << " bytes\n"
+        << "Rate " << stats.raw_size / time_span / 1024 / 1024 << " MB/s, "
+        << stats.files / time_span << " files/s\n";
+    if (stats.in_size)
+        cout << stats.out_size * 100.0 / stats.in_size << "% of the input\n";
+    return stats.failed ? 2 : 0;
+}
+
 int main(int argc, char** argv)
 {
     options opts;
     if (!parse_args(argc, argv, opts))
         return Usage(opts);
-    return opts.decode ? decode_main(opts) : encode_main(opts);
+    // Keep stdout clean when it is the output
+    if (opts.out_fname == "-")
+        cout.rdbuf(cerr.rdbuf());
+    if (opts.decode)
+        return decode_main(opts);
+    return is_batch(opts.in_fname) ? batch_main(opts) : encode_main(opts);
 }